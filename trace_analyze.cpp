@@ -0,0 +1,256 @@
+/*
+    trace_analyze [--compensate] [--concurrency] [--bucket us] [--profile out.json] trace.json...
+
+    Prints the spans of one or more trace files per name: how many there were, and their
+    total, mean, shortest and longest durations in microseconds, longest total first.
+
+    With --compensate, the cost of tracing itself is taken out of every span, using the
+    "tracelib_overhead" record trace_start writes for each process: the overhead of an empty
+    span, plus the cost of each record made inside the span (its nested spans' starts and
+    ends, counters, instants). This matters for spans of a microsecond or less, where
+    tracing can take longer than the code being measured.
+
+    With --concurrency, also sweeps over the starts and ends of each name's spans to find
+    how many were open at once: the most at any moment, the average over the window from the
+    first start to the last end, and the average while at least one was open (the parallelism
+    achieved). A name whose spans never overlap, like a critical section behind a mutex, shows
+    1.0 however many threads run it. --profile writes the same as counter events, the average
+    number open in each bucket of --bucket microseconds (1/500 of the trace by default), which
+    can be viewed on its own or merged with the trace by trace_merge.
+*/
+#include "tracereader.h"
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <cstdio>
+#include <cfloat>
+#include <cmath>
+
+using namespace std;
+
+struct Overhead
+{
+    double span = 0; //Microseconds an empty span measures
+    double event = 0; //Microseconds one record adds to the span around it
+};
+
+struct OpenSpan
+{
+    trace::TraceString name;
+    double ts;
+    size_t records; //Records on the thread up to and including this span's start
+};
+
+struct ThreadState
+{
+    vector<OpenSpan> spans;
+    size_t records = 0;
+};
+
+struct Stats
+{
+    size_t count = 0;
+    double total = 0;
+    double shortest = DBL_MAX;
+    double longest = 0;
+};
+
+typedef pair<double, int> Edge; //Timestamp, +1 for a span start or -1 for an end
+
+struct Concurrency
+{
+    int most = 0;
+    double busy = 0; //Integral of the number of open spans over time
+    double active = 0; //Time with at least one span open
+    double window = 0; //First start to last end
+    vector<double> buckets; //busy per bucket
+};
+
+/*
+    Concurrency sweep(edges, origin, bucket, buckets)
+
+    Walks the sorted starts and ends of one name's spans, integrating the number of open spans
+    over time, overall and per bucket of the given width from origin.
+*/
+static Concurrency sweep(const vector<Edge>& edges, double origin, double bucket, size_t buckets)
+{
+    Concurrency c;
+    c.buckets.assign(buckets, 0);
+    if(edges.empty()) return c;
+    c.window = edges.back().first - edges.front().first;
+    int open = 0;
+    double last = edges.front().first;
+    for(const Edge& edge : edges)
+    {
+        if(open > 0)
+        {
+            c.busy += open * (edge.first - last);
+            c.active += edge.first - last;
+            for(double t = last; t < edge.first; ) //Spread over the buckets it covers
+            {
+                size_t i = min(buckets - 1, size_t((t - origin) / bucket));
+                while(i + 1 < buckets && origin + (i + 1) * bucket <= t) i++; //Rounded down onto a boundary
+                double end = i + 1 < buckets ? min(edge.first, origin + (i + 1) * bucket) : edge.first;
+                c.buckets[i] += open * (end - t);
+                t = end;
+            }
+        }
+        open += edge.second;
+        c.most = max(c.most, open);
+        last = edge.first;
+    }
+    return c;
+}
+
+int main(int argc, char** argv)
+{
+    bool compensate = false;
+    bool concurrency = false;
+    double bucket = 0;
+    const char* profile = nullptr;
+    vector<const char*> files;
+    for(int i=1; i<argc; i++)
+    {
+        if(strcmp(argv[i], "--compensate") == 0) compensate = true;
+        else if(strcmp(argv[i], "--concurrency") == 0) concurrency = true;
+        else if(strcmp(argv[i], "--bucket") == 0 && i+1 < argc) bucket = atof(argv[++i]);
+        else if(strcmp(argv[i], "--profile") == 0 && i+1 < argc) profile = argv[++i], concurrency = true;
+        else files.push_back(argv[i]);
+    }
+    if(files.empty())
+    {
+        cerr << "Usage: " << argv[0] << " [--compensate] [--concurrency] [--bucket us] [--profile out.json] trace.json...\n";
+        return 1;
+    }
+
+    map<string, Stats> stats;
+    map<string, vector<Edge>> edges; //Span starts and ends by name, for --concurrency
+    map<int, Overhead> overheads; //By pid
+    for(const char* file : files)
+    {
+        trace::TraceFile trace;
+        if(!trace.open(file)) return 1;
+        vector<trace::TraceEvent> events = trace.events();
+        //Usually in time order already (see TraceFile); span pairing needs it exact
+        auto earlier = [](const trace::TraceEvent& a, const trace::TraceEvent& b){ return a.ts < b.ts; };
+        if(!is_sorted(events.begin(), events.end(), earlier)) stable_sort(events.begin(), events.end(), earlier);
+
+        map<pair<int, int>, ThreadState> threads; //By pid and tid
+        for(const trace::TraceEvent& event : events)
+        {
+            int pid = event.pid;
+            if(event.phase == 'M')
+            {
+                Overhead overhead;
+                if(event.name == "tracelib_overhead" && trace::event_arg(event, "span_ns", overhead.span) && trace::event_arg(event, "event_ns", overhead.event))
+                {
+                    overhead.span /= 1000;
+                    overhead.event /= 1000;
+                    overheads[pid] = overhead;
+                }
+                continue;
+            }
+            if(event.ts == trace::NO_TIMESTAMP) continue;
+
+            ThreadState& thread = threads[make_pair(pid, event.tid)];
+            if(event.phase == 'B')
+            {
+                thread.records++;
+                thread.spans.push_back(OpenSpan{event.name, event.ts, thread.records});
+            }
+            else if(event.phase == 'E' && !thread.spans.empty())
+            {
+                OpenSpan span = thread.spans.back();
+                thread.spans.pop_back();
+                double duration = event.ts - span.ts;
+                if(concurrency)
+                {
+                    vector<Edge>& named = edges[span.name.str()];
+                    named.push_back(Edge(span.ts, 1));
+                    named.push_back(Edge(event.ts, -1));
+                }
+                auto overhead = overheads.find(pid);
+                if(compensate && overhead != overheads.end())
+                {
+                    duration -= overhead->second.span + (thread.records - span.records) * overhead->second.event;
+                    if(duration < 0) duration = 0;
+                }
+                thread.records++;
+
+                Stats& s = stats[span.name.str()];
+                s.count++;
+                s.total += duration;
+                s.shortest = min(s.shortest, duration);
+                s.longest = max(s.longest, duration);
+            }
+            else thread.records++;
+        }
+    }
+
+    if(compensate)
+    {
+        for(auto const& overhead : overheads)
+        {
+            printf("pid %i: %.3f us per span, %.3f us per nested record subtracted\n", overhead.first, overhead.second.span, overhead.second.event);
+        }
+        if(overheads.empty()) cerr << "Warning: No tracelib_overhead record found; nothing was subtracted.\n";
+    }
+
+    vector<pair<string, Stats>> rows(stats.begin(), stats.end());
+    sort(rows.begin(), rows.end(),
+        [](const pair<string, Stats>& a, const pair<string, Stats>& b){ return a.second.total > b.second.total; });
+    printf("%-32s %10s %14s %12s %12s %12s\n", "name", "count", "total us", "mean us", "min us", "max us");
+    for(auto const& row : rows)
+    {
+        const Stats& s = row.second;
+        printf("%-32s %10zu %14.3f %12.3f %12.3f %12.3f\n", row.first.c_str(), s.count, s.total, s.total / s.count, s.shortest, s.longest);
+    }
+    if(!concurrency || edges.empty()) return 0;
+
+    double first = DBL_MAX, last = -DBL_MAX;
+    for(auto& named : edges)
+    {
+        sort(named.second.begin(), named.second.end()); //Ends before starts at the same time
+        first = min(first, named.second.front().first);
+        last = max(last, named.second.back().first);
+    }
+    if(bucket <= 0) bucket = max((last - first) / 500, 0.001);
+    size_t buckets = max<size_t>(1, size_t(ceil((last - first) / bucket)));
+
+    printf("\n%-32s %10s %12s %12s %14s\n", "concurrency", "most", "avg window", "avg active", "window us");
+    vector<pair<string, Concurrency>> profiles;
+    for(auto const& named : edges)
+    {
+        Concurrency c = sweep(named.second, first, bucket, buckets);
+        printf("%-32s %10i %12.3f %12.3f %14.3f\n", named.first.c_str(), c.most,
+            c.window > 0 ? c.busy / c.window : 0.0, c.active > 0 ? c.busy / c.active : 0.0, c.window);
+        profiles.push_back(make_pair(named.first, c));
+    }
+    if(!profile) return 0;
+
+    FILE* output = fopen(profile, "w");
+    if(!output)
+    {
+        cerr << "Error: Unable to open file \"" << profile << "\" for the concurrency profile.\n";
+        return 1;
+    }
+    fputs("[\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0, \"args\": { \"name\": \"concurrency\"} }", output);
+    size_t written = 0;
+    for(auto const& named : profiles)
+    {
+        double previous = -1;
+        for(size_t i=0; i<buckets; i++)
+        {
+            double value = named.second.buckets[i] / bucket;
+            if(value == previous) continue; //Only changes are needed
+            fprintf(output, ",\n{\"name\": \"%s\", \"ph\": \"C\", \"pid\": 0, \"tid\": 0, \"ts\": %.3f, \"args\": { \"open\": %.3f} }",
+                named.first.c_str(), first + i * bucket, value);
+            previous = value;
+            written++;
+        }
+    }
+    fputs("\n]", output);
+    fclose(output);
+    cout << "Wrote " << written << " counter events to " << profile << "\n";
+    return 0;
+}
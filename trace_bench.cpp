@@ -0,0 +1,117 @@
+/*
+    trace_bench [megabytes] [directory]
+
+    Compares the throughput of the ways tracelib can write its output:
+
+    ofstream   each record streamed with <<, as trace_flush originally did
+    pwrite     TraceWriter with TRACE_WRITER_PWRITE, one pwritev() per flush
+    io_uring   TraceWriter with TRACE_WRITER_URING
+    gzip       TraceWriter with TRACE_WRITER_PWRITE and TRACE_COMPRESS_GZIP (built with zlib)
+
+    Every run writes the same formatted records in flushes of TRACE_MAX records, and
+    includes close() and fsync() in its time so page-cache writeback is counted.
+*/
+#include "tracelib.h"
+#include <fstream>
+#include <cstdlib>
+
+using namespace std;
+
+static vector<string> make_flush()
+{
+    vector<string> records;
+    char buffer[256];
+    for(int i=0; i<trace::TRACE_MAX; i++)
+    {
+        snprintf(buffer, sizeof(buffer),
+        ",\n{\"name\": \"Method1Incr\", \"cat\": \"bench\", \"ph\": \"%c\", \"pid\": 1, \"tid\": %i, \"ts\": %i}",
+        i % 2 ? 'E' : 'B', i % 1000 + 2, i);
+        records.push_back(buffer);
+    }
+    return records;
+}
+
+static double seconds_since(trace::Clock::time_point start)
+{
+    return chrono::duration<double>(trace::Clock::now() - start).count();
+}
+
+static void report(const char* name, size_t bytes, double seconds)
+{
+    printf("%-10s %8.1f MB in %6.3f s  %8.1f MB/s\n", name, bytes / 1e6, seconds, bytes / 1e6 / seconds);
+}
+
+static void sync_file(const string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd >= 0) { fsync(fd); close(fd); }
+}
+
+int main(int argc, char** argv)
+{
+    size_t megabytes = argc > 1 ? strtoul(argv[1], nullptr, 10) : 256;
+    string directory = argc > 2 ? argv[2] : "/tmp";
+    string path = directory + "/trace_bench.json";
+
+    vector<string> records = make_flush();
+    size_t flushBytes = 0;
+    for(auto const& value : records) flushBytes += value.size();
+    size_t flushes = (megabytes * 1000000 + flushBytes - 1) / flushBytes;
+    size_t total = flushes * flushBytes;
+
+    {
+        auto start = trace::Clock::now();
+        ofstream file(path);
+        for(size_t f=0; f<flushes; f++)
+        {
+            for(auto const& value : records) file << value;
+        }
+        file.close();
+        sync_file(path);
+        report("ofstream", total, seconds_since(start));
+    }
+
+    struct Run { const char* name; int backend; int compress; };
+    const Run runs[] = {
+        { "pwrite", trace::TRACE_WRITER_PWRITE, trace::TRACE_COMPRESS_NONE },
+        { "io_uring", trace::TRACE_WRITER_URING, trace::TRACE_COMPRESS_NONE },
+#ifdef TRACELIB_WITH_ZLIB
+        { "gzip", trace::TRACE_WRITER_PWRITE, trace::TRACE_COMPRESS_GZIP },
+#endif
+    };
+    for(const Run& run : runs)
+    {
+        int backend = run.backend;
+        auto start = trace::Clock::now();
+        trace::TraceWriter writer;
+        if(!writer.open(path.c_str(), backend, trace::SHM_SIZE, run.compress))
+        {
+            cerr << "Error: Unable to open \"" << path << "\".\n";
+            return 1;
+        }
+        if(backend == trace::TRACE_WRITER_URING && writer.backend_in_use() != backend)
+        {
+            writer.close();
+            printf("%-10s unavailable\n", "io_uring");
+            continue;
+        }
+        vector<struct iovec> iov(records.size());
+        for(size_t f=0; f<flushes; f++)
+        {
+            for(size_t i=0; i<records.size(); i++)
+            {
+                iov[i].iov_base = &records[i][0];
+                iov[i].iov_len = records[i].size();
+            }
+            writer.append(iov.data(), iov.size());
+        }
+        uint64_t written = writer.offset();
+        writer.close();
+        sync_file(path);
+        report(run.name, total, seconds_since(start));
+        if(run.compress != trace::TRACE_COMPRESS_NONE) printf("%-10s %8.1f MB on disk\n", "", written / 1e6);
+    }
+
+    unlink(path.c_str());
+    return 0;
+}
@@ -0,0 +1,1131 @@
+/*
+    trace_check [directory]
+
+    Records traces through tracelib in configurations whose output has been broken before,
+    and checks the files written. Prints one line per check and exits nonzero if any fails.
+
+    writer     a trace written through TRACE_WRITER_URING, or the pwritev() it falls back to,
+               reads back through TraceFile with every span it recorded
+    compress   a .json.gz trace reads back through TraceFile with every span it recorded, when
+               built with TRACELIB_WITH_ZLIB
+    jsonl      every line of a TRACE_FORMAT_JSONL trace, chunk index included, is one JSON
+               value
+    shm        a TRACE_WRITER_SHM ring that fills with no collector attached holds whole
+               appends only, and counts the ones it dropped
+    order      timestamps never go back in a trace from threads that retire small buffers
+               while another thread keeps flushing, with and without a memory budget
+    process    events carry the real pid and CLOCK_MONOTONIC timestamps, and the process is
+               named as set with trace_set_process_name
+    tracers    two Tracer objects recording from the same threads at once each write only
+               their own spans, all of them
+    counter    a numeric counter records each change of value once, and under a counter
+               interval only its first value and the last one held back
+    elided     spans under their minimum duration are dropped and counted in the "(elided)"
+               summary, while longer ones and ones with records inside are kept
+    points     TRACE_SCOPE and TRACE_INSTANT sites record nothing while switched off, through
+               TRACELIB_DISABLE at trace_start or trace_enable_points while tracing
+    sched      with scheduler stats on, a span spinning on the CPU is reported on-CPU and a
+               span sleeping is reported off-CPU
+    context    a span context handed to other threads makes their spans children in the same
+               trace, with each flow started once and ended once
+    hits       TRACE_COUNT hits from threads that exited are summed at each flush, counting
+               from trace_start
+    reserve    trace_end on a thread holding a reservation finishes, keeps the events filled
+               before it and refuses those after it
+    strings    names and categories from a reused stack buffer are written as they were when
+               recorded
+    filter     TraceFile::events with a name, tid and time filter, narrowed through the chunk
+               index, finds the same events as checking each one
+    stack      a captured call stack follows the frame pointers of nested calls and ends at
+               the outermost frame instead of running off into garbage
+    signal     records from signal handlers raised between small buffers that retire are all
+               written, in time order, without an explicit flush
+    calibrate  every session, of the default tracer or another one, writes the overhead
+               measured once for the process
+    parallel   trace_analyze --concurrency finds the most spans open at once and the
+               parallelism of a name whose spans overlap and one whose spans take turns
+    window     trace_lod --window keeps the spans crossing its edges matched, closing one
+               never ended at the end of the window, and leaves out those outside it
+    kernel     trace_sched turns sched_switch, sched_wakeup and marker lines into the
+               running and runnable slices of the traced thread and the tasks of its CPU
+*/
+#include "tracelib.h"
+#include "tracereader.h"
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <future>
+#include <map>
+#include <thread>
+#include <signal.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static void json_space(const char*& p, const char* end) //Skips whitespace
+{
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+}
+
+static bool json_string(const char*& p, const char* end) //Skips one string, quotes included
+{
+    if(p == end || *p != '"') return false;
+    for(p++; p < end && *p != '"'; p++)
+    {
+        if((unsigned char)*p < 0x20) return false; //Control characters must be escaped
+        if(*p == '\\' && ++p == end) return false;
+    }
+    if(p == end) return false;
+    p++;
+    return true;
+}
+
+/*
+    bool json_value(p, end)
+
+    Skips one JSON value at p, with the whitespace around it. Output is false if the text is
+    not valid JSON.
+*/
+static bool json_value(const char*& p, const char* end)
+{
+    json_space(p, end);
+    if(p == end) return false;
+    if(*p == '{' || *p == '[')
+    {
+        char close = *p == '{' ? '}' : ']';
+        bool object = *p == '{';
+        p++;
+        json_space(p, end);
+        if(p < end && *p == close)
+        {
+            p++;
+            json_space(p, end);
+            return true;
+        }
+        while(true)
+        {
+            if(object)
+            {
+                json_space(p, end);
+                if(!json_string(p, end)) return false;
+                json_space(p, end);
+                if(p == end || *p++ != ':') return false;
+            }
+            if(!json_value(p, end)) return false;
+            if(p == end) return false;
+            if(*p == close) break;
+            if(*p++ != ',') return false;
+        }
+        p++;
+    }
+    else if(*p == '"')
+    {
+        if(!json_string(p, end)) return false;
+    }
+    else if(end - p >= 4 && (strncmp(p, "true", 4) == 0 || strncmp(p, "null", 4) == 0)) p += 4;
+    else if(end - p >= 5 && strncmp(p, "false", 5) == 0) p += 5;
+    else
+    {
+        char* after;
+        strtod(p, &after);
+        if(after == p || after > end) return false;
+        p = after;
+    }
+    json_space(p, end);
+    return true;
+}
+
+static string read_file(const string& path)
+{
+    ifstream file(path, ios::binary);
+    return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+static int failures = 0;
+
+static void report(const char* name, bool ok, const string& detail)
+{
+    printf("%-10s %s%s%s\n", name, ok ? "ok" : "FAILED", detail.empty() ? "" : ": ", detail.c_str());
+    if(!ok) failures++;
+}
+
+/*
+    void record_threads(threads, spans)
+
+    Records nested spans and a counter from several threads, in buffers small enough that
+    they are retired and flushed many times.
+*/
+static void record_threads(int threads, int spans)
+{
+    vector<thread> workers;
+    for(int t=0; t<threads; t++)
+    {
+        workers.emplace_back([spans]
+        {
+            for(int i=0; i<spans; i++)
+            {
+                trace::trace_event_start("outer", "check");
+                trace::trace_event_start("inner", "check");
+                trace::trace_counter_int("progress", i);
+                trace::trace_event_end();
+                trace::trace_event_end();
+            }
+        });
+    }
+    for(auto& worker : workers) worker.join();
+}
+
+/*
+    size_t out_of_order(text, records)
+
+    Output is the number of timestamps in a JSON trace that are earlier than one before them.
+    records is set to the number of timestamps.
+*/
+static size_t out_of_order(const string& text, size_t& records)
+{
+    size_t back = 0;
+    double last = 0;
+    records = 0;
+    for(size_t at = text.find("\"ts\": "); at != string::npos; at = text.find("\"ts\": ", at + 1))
+    {
+        double ts = strtod(text.c_str() + at + 6, nullptr);
+        if(ts < last) back++;
+        last = max(last, ts);
+        records++;
+    }
+    return back;
+}
+
+static size_t read_spans(const string& path, const char* name, char phase='B') //Spans (or other events) named name, read back through TraceFile
+{
+    trace::TraceFile file;
+    size_t spans = 0;
+    if(file.open(path.c_str()))
+    {
+        for(const trace::TraceEvent& event : file) if(event.phase == phase && event.name == name) spans++;
+    }
+    file.close();
+    return spans;
+}
+
+static void check_writer(const string& directory)
+{
+    string path = directory + "/trace_check_writer.json";
+    trace::trace_set_writer(trace::TRACE_WRITER_URING);
+    trace::trace_set_buffer_size(1000);
+    if(!trace::trace_start(path.c_str()))
+    {
+        report("writer", false, "unable to start");
+        return;
+    }
+    const int spans = 50000;
+    for(int i=0; i<spans; i++)
+    {
+        trace::trace_event_start("written", "check");
+        trace::trace_event_end();
+    }
+    trace::trace_end();
+    trace::trace_set_buffer_size(trace::TRACE_MAX);
+    trace::trace_set_writer(trace::TRACE_WRITER_PWRITE);
+
+    size_t found = read_spans(path, "written");
+    unlink(path.c_str());
+    report("writer", found == size_t(spans), to_string(found) + " of " + to_string(spans) + " spans read back");
+}
+
+static void check_compress(const string& directory)
+{
+#ifdef TRACELIB_WITH_ZLIB
+    string path = directory + "/trace_check_compress.json.gz";
+    trace::trace_set_buffer_size(1000);
+    if(!trace::trace_start(path.c_str()))
+    {
+        report("compress", false, "unable to start");
+        return;
+    }
+    const int spans = 50000;
+    for(int i=0; i<spans; i++)
+    {
+        trace::trace_event_start("compressed", "check");
+        trace::trace_event_end();
+    }
+    trace::trace_end();
+    trace::trace_set_buffer_size(trace::TRACE_MAX);
+
+    string text = read_file(path);
+    bool gzip = text.size() > 2 && text[0] == '\x1f' && text[1] == '\x8b'; //The gzip magic number
+    size_t found = read_spans(path, "compressed");
+    unlink(path.c_str());
+    report("compress", gzip && found == size_t(spans),
+        to_string(found) + " of " + to_string(spans) + " spans read back" + (gzip ? "" : ", file not gzip"));
+#else
+    report("compress", true, "skipped, built without TRACELIB_WITH_ZLIB");
+    (void)directory;
+#endif
+}
+
+static void check_jsonl(const string& directory)
+{
+    string path = directory + "/trace_check.jsonl";
+    trace::trace_set_output_format(trace::TRACE_FORMAT_JSONL);
+    trace::trace_set_buffer_size(500);
+    if(!trace::trace_start(path.c_str()))
+    {
+        report("jsonl", false, "unable to start");
+        return;
+    }
+    record_threads(4, 5000);
+    trace::trace_end();
+    trace::trace_set_output_format(trace::TRACE_FORMAT_JSON);
+    trace::trace_set_buffer_size(trace::TRACE_MAX);
+
+    string text = read_file(path);
+    size_t lines = 0, bad = 0, index = 0;
+    size_t begin = 0;
+    while(begin < text.size())
+    {
+        size_t end = text.find('\n', begin);
+        if(end == string::npos) end = text.size();
+        const char* p = text.data() + begin;
+        if(!json_value(p, text.data() + end) || p != text.data() + end) bad++;
+        if(text.compare(begin, 24, "{\"name\": \"trace_index\", ") == 0) index++;
+        lines++;
+        begin = end + 1;
+    }
+    unlink(path.c_str());
+    report("jsonl", bad == 0 && index == 1 && lines > 0,
+        to_string(lines) + " lines, " + to_string(bad) + " invalid, " + to_string(index) + " index");
+}
+
+static void check_shm(const string& directory)
+{
+    string path = directory + "/trace_check_shm.json";
+    trace::trace_set_writer(trace::TRACE_WRITER_SHM);
+    trace::trace_set_shm_size(64 << 10);
+    trace::trace_set_buffer_size(500);
+    bool started = trace::trace_start(path.c_str());
+    for(int i=0; started && i<50; i++) //Flushes of about 20KB, so some fit in the ring
+    {
+        record_threads(2, 50);
+        trace::trace_flush();
+    }
+    if(started) trace::trace_end();
+    trace::trace_set_writer(trace::TRACE_WRITER_PWRITE);
+    trace::trace_set_shm_size(trace::SHM_SIZE);
+    trace::trace_set_buffer_size(trace::TRACE_MAX);
+    if(!started)
+    {
+        report("shm", false, "unable to start");
+        return;
+    }
+
+    //Read the ring as trace_collector would, without one ever attaching
+    string name = trace::trace_shm_name(getpid());
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    struct stat info;
+    void* memory = MAP_FAILED;
+    if(fd >= 0 && fstat(fd, &info) == 0) memory = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(fd >= 0) close(fd);
+    shm_unlink(name.c_str());
+    if(memory == MAP_FAILED)
+    {
+        report("shm", false, "unable to map " + name);
+        return;
+    }
+    const trace::ShmHeader* shm = (const trace::ShmHeader*)memory;
+    uint64_t read = shm->readPos.load(), write = shm->writePos.load();
+    uint64_t mask = shm->capacity - 1;
+    string text;
+    for(uint64_t i=read; i<write; i++) text += shm->ring[i & mask];
+    uint64_t appends = shm->droppedAppends.load(), bytes = shm->dropped.load();
+    munmap(memory, info.st_size);
+
+    size_t last = text.find_last_not_of(" \n");
+    if(last == string::npos || text[last] != ']') text += "\n]"; //As trace_collector closes it
+    const char* p = text.data();
+    bool valid = json_value(p, text.data() + text.size()) && p == text.data() + text.size();
+    report("shm", valid && appends > 0,
+        to_string(text.size()) + " bytes " + (valid ? "valid" : "invalid") + ", " + to_string(appends) + " appends (" + to_string(bytes) + " bytes) dropped");
+}
+
+static void check_order(const string& directory, size_t budget)
+{
+    const char* name = budget ? "order-mem" : "order";
+    string path = directory + "/trace_check_order.json";
+    trace::trace_set_buffer_size(100);
+    trace::trace_set_memory_budget(budget);
+    if(!trace::trace_start(path.c_str()))
+    {
+        report(name, false, "unable to start");
+        return;
+    }
+    atomic<bool> done{false};
+    thread flusher([&done]
+    {
+        while(!done.load())
+        {
+            trace::trace_flush();
+            this_thread::yield();
+        }
+    });
+    record_threads(8, 2000);
+    done = true;
+    flusher.join();
+    trace::trace_end();
+    trace::trace_set_buffer_size(trace::TRACE_MAX);
+    trace::trace_set_memory_budget(0);
+
+    string text = read_file(path);
+    const char* p = text.data();
+    bool valid = json_value(p, text.data() + text.size()) && p == text.data() + text.size();
+    size_t records;
+    size_t back = out_of_order(text, records);
+    unlink(path.c_str());
+    report(name, valid && back == 0 && records > 0,
+        to_string(records) + " timestamps, " + to_string(back) + " out of order" + (valid ? "" : ", invalid JSON"));
+}
+
+static void check_process(const string& directory)
+{
+    string path = directory + "/trace_check_process.json";
+    trace::trace_set_process_name("checked process");
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double before = now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+    if(!trace::trace_start(path.c_str()))
+    {
+        report("process", false, "unable to start");
+        return;
+    }
+    trace::trace_event_start("timed", "check");
+    trace::trace_event_end();
+    trace::trace_end();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double after = now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+    trace::trace_set_process_name("");
+
+    trace::TraceFile file;
+    size_t events = 0, wrongPid = 0, outside = 0;
+    bool named = false;
+    if(file.open(path.c_str()))
+    {
+        for(const trace::TraceEvent& event : file)
+        {
+            if(trace::event_is_index(event)) continue;
+            events++;
+            if(event.pid != getpid()) wrongPid++;
+            if(event.ts != trace::NO_TIMESTAMP && (event.ts < before - 1 || event.ts > after + 1)) outside++;
+            if(event.name == "process_name") named = string(event.text, event.length).find("\"checked process\"") != string::npos;
+        }
+    }
+    file.close();
+    unlink(path.c_str());
+    report("process", events > 0 && wrongPid == 0 && outside == 0 && named,
+        to_string(wrongPid) + " of " + to_string(events) + " events with another pid, " + to_string(outside) + " outside the session's clock"
+        + (named ? "" : ", process not named"));
+}
+
+static void check_tracers(const string& directory)
+{
+    string paths[2] = { directory + "/trace_check_tracers0.json", directory + "/trace_check_tracers1.json" };
+    trace::Tracer tracers[2];
+    for(int t=0; t<2; t++)
+    {
+        tracers[t].set_buffer_size(100);
+        if(!tracers[t].start(paths[t].c_str()))
+        {
+            if(t == 1) tracers[0].end();
+            report("tracers", false, "unable to start");
+            return;
+        }
+    }
+    const char* names[2] = { "first", "second" };
+    const int threads = 4, spans = 5000;
+    vector<thread> workers;
+    for(int w=0; w<threads; w++)
+    {
+        workers.emplace_back([&]
+        {
+            for(int i=0; i<spans; i++)
+            {
+                for(int t=0; t<2; t++) tracers[t].event_start(names[t], "check");
+                for(int t=1; t>=0; t--) tracers[t].event_end();
+            }
+        });
+    }
+    for(thread& worker : workers) worker.join();
+    for(int t=0; t<2; t++) tracers[t].end();
+
+    size_t own[2], other[2];
+    for(int t=0; t<2; t++)
+    {
+        own[t] = read_spans(paths[t], names[t]);
+        other[t] = read_spans(paths[t], names[1 - t]);
+        unlink(paths[t].c_str());
+    }
+    size_t expected = size_t(threads) * spans;
+    report("tracers", own[0] == expected && own[1] == expected && other[0] == 0 && other[1] == 0,
+        to_string(own[0]) + " and " + to_string(own[1]) + " of " + to_string(expected) + " spans, "
+        + to_string(other[0] + other[1]) + " in the other tracer's file");
+}
+
+static vector<double> counter_values(const string& path, unsigned int interval) //Values recorded for 0, 0, 1, 1, ... 499, 499
+{
+    vector<double> values;
+    trace::trace_set_counter_interval(interval);
+    if(!trace::trace_start(path.c_str())) return values;
+    for(int i=0; i<1000; i++) trace::trace_counter_int("checked", i / 2);
+    trace::trace_end();
+    trace::trace_set_counter_interval(0);
+
+    trace::TraceFile file;
+    if(file.open(path.c_str()))
+    {
+        double value;
+        for(const trace::TraceEvent& event : file) if(event.phase == 'C' && event.name == "checked" && trace::event_arg(event, "value", value)) values.push_back(value);
+    }
+    file.close();
+    unlink(path.c_str());
+    return values;
+}
+
+static void check_counter(const string& directory)
+{
+    string path = directory + "/trace_check_counter.json";
+    vector<double> changes = counter_values(path, 0);
+    vector<double> limited = counter_values(path, 60000000); //A minute, longer than the loop takes
+    bool values = limited.size() != 2 || (limited[0] == 0 && limited[1] == 499);
+    for(size_t i=0; i<changes.size(); i++) values = values && changes[i] == double(i);
+    report("counter", changes.size() == 500 && limited.size() == 2 && values,
+        to_string(changes.size()) + " of 500 changes recorded, " + to_string(limited.size()) + " of 2 under the interval" + (values ? "" : ", wrong values"));
+}
+
+static void check_elided(const string& directory)
+{
+    string path = directory + "/trace_check_elided.json";
+    trace::trace_set_min_duration("short", 50000000); //50ms, past any preemption of an empty span
+    if(!trace::trace_start(path.c_str()))
+    {
+        trace::trace_set_min_duration("short", 0);
+        report("elided", false, "unable to start");
+        return;
+    }
+    const int threads = 2, spans = 500;
+    vector<thread> workers;
+    for(int w=0; w<threads; w++)
+    {
+        workers.emplace_back([]
+        {
+            for(int i=0; i<spans; i++)
+            {
+                trace::trace_event_start("short", "check");
+                trace::trace_event_end();
+            }
+            trace::trace_event_start("short", "check"); //Kept for the record inside
+            trace::trace_instant_global("inside");
+            trace::trace_event_end();
+        });
+    }
+    for(thread& worker : workers) worker.join();
+    trace::trace_event_start("short", "check"); //Kept for its length
+    this_thread::sleep_for(chrono::milliseconds(60));
+    trace::trace_event_end();
+    trace::trace_end();
+    trace::trace_set_min_duration("short", 0);
+
+    size_t kept = read_spans(path, "short");
+    double count = 0;
+    trace::TraceFile file;
+    if(file.open(path.c_str()))
+    {
+        for(const trace::TraceEvent& event : file) if(event.name == "short (elided)") trace::event_arg(event, "count", count);
+    }
+    file.close();
+    unlink(path.c_str());
+    size_t expected = threads + 1;
+    report("elided", kept == expected && count == threads * spans,
+        to_string(kept) + " of " + to_string(expected) + " spans kept, " + to_string(int64_t(count)) + " of " + to_string(threads * spans) + " counted as elided");
+}
+
+static void run_points(int times)
+{
+    for(int i=0; i<times; i++)
+    {
+        TRACE_SCOPE("check_point_scope", "check");
+        TRACE_INSTANT("check_point_instant", "check");
+    }
+}
+
+static void check_points(const string& directory)
+{
+    string path = directory + "/trace_check_points.json";
+    setenv("TRACELIB_DISABLE", "check_point_scope", 1);
+    bool started = trace::trace_start(path.c_str());
+    unsetenv("TRACELIB_DISABLE");
+    if(!started)
+    {
+        trace::trace_enable_points("check_point_scope", true);
+        report("points", false, "unable to start");
+        return;
+    }
+    run_points(10); //Instants only
+    int switched = trace::trace_enable_points("check_point_scope", true) + trace::trace_enable_points("check_point_instant", false);
+    run_points(20); //Spans only
+    trace::trace_end();
+    trace::trace_enable_points("check_point_instant", true);
+
+    size_t spans = read_spans(path, "check_point_scope");
+    size_t instants = read_spans(path, "check_point_instant", 'i');
+    unlink(path.c_str());
+    report("points", switched == 2 && spans == 20 && instants == 10,
+        to_string(spans) + " of 20 spans, " + to_string(instants) + " of 10 instants, " + to_string(switched) + " of 2 sites switched");
+}
+
+static void check_sched(const string& directory)
+{
+    string path = directory + "/trace_check_sched.json";
+    trace::trace_set_sched_stats(true);
+    if(!trace::trace_start(path.c_str()))
+    {
+        trace::trace_set_sched_stats(false);
+        report("sched", false, "unable to start");
+        return;
+    }
+    struct timespec spent;
+    trace::trace_event_start("spinning", "check");
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &spent);
+    int64_t until = spent.tv_sec * int64_t(1000000000) + spent.tv_nsec + 20000000; //20ms more of this thread's CPU time
+    do clock_gettime(CLOCK_THREAD_CPUTIME_ID, &spent);
+    while(spent.tv_sec * int64_t(1000000000) + spent.tv_nsec < until);
+    trace::trace_event_end();
+    trace::trace_event_start("sleeping", "check");
+    this_thread::sleep_for(chrono::milliseconds(20));
+    trace::trace_event_end();
+    trace::trace_end();
+    trace::trace_set_sched_stats(false);
+
+    vector<pair<double, double>> parts; //On-CPU and off-CPU microseconds of each span, in order
+    trace::TraceFile file;
+    if(file.open(path.c_str()))
+    {
+        double on, off;
+        for(const trace::TraceEvent& event : file)
+        {
+            if(event.phase == 'E' && trace::event_arg(event, "on_cpu_us", on) && trace::event_arg(event, "off_cpu_us", off)) parts.push_back(make_pair(on, off));
+        }
+    }
+    file.close();
+    unlink(path.c_str());
+    //Preemption can add any amount of off-CPU time to the spinning span, but not on-CPU time to the sleeping one
+    size_t broken = parts.size();
+    parts.resize(2, make_pair(0.0, 0.0));
+    bool spinning = parts[0].first >= 20000;
+    bool sleeping = parts[1].second >= 10000 && parts[1].first < 5000;
+    char detail[160];
+    snprintf(detail, sizeof(detail), "%zu of 2 spans broken down, spinning %.0fus on-CPU and %.0fus off, sleeping %.0fus on-CPU and %.0fus off",
+        broken, parts[0].first, parts[0].second, parts[1].first, parts[1].second);
+    report("sched", broken == 2 && spinning && sleeping, detail);
+}
+
+static void check_context(const string& directory)
+{
+    string path = directory + "/trace_check_context.json";
+    if(!trace::trace_start(path.c_str()))
+    {
+        report("context", false, "unable to start");
+        return;
+    }
+    const int requests = 3;
+    for(int i=0; i<requests; i++) //Each request hands off to a handler, which hands off to a task
+    {
+        trace::trace_event_start("request", "check");
+        trace::SpanContext request = trace::trace_context_capture();
+        thread([request]
+        {
+            trace::TraceContextScope scope(request);
+            trace::trace_event_start("handler", "check");
+            trace::SpanContext handler = trace::trace_context_capture();
+            thread([handler]
+            {
+                trace::TraceContextScope scope(handler);
+                trace::trace_event_start("task", "check");
+                trace::trace_event_end();
+            }).join();
+            trace::trace_event_end();
+        }).join();
+        trace::trace_event_end();
+    }
+    trace::trace_end();
+
+    //Flow starts carry the captured span's ids, and the spans adopting them their parent's
+    vector<pair<double, double>> captured; //Trace and span id of each flow start
+    vector<vector<double>> adopted; //Trace, span and parent id of each handler, then task
+    map<double, int> flows; //Flow starts less ends by id
+    trace::TraceFile file;
+    if(file.open(path.c_str()))
+    {
+        double trace, span, parent, id;
+        for(const trace::TraceEvent& event : file)
+        {
+            string text(event.text, event.length);
+            size_t at = text.find("\"id\": "); //The flow id, outside the args
+            if((event.phase == 's' || event.phase == 'f') && at != string::npos)
+            {
+                id = atof(text.c_str() + at + 6);
+                flows[id] += event.phase == 's' ? 1 : -1;
+            }
+            if(event.phase == 's' && trace::event_arg(event, "trace_id", trace) && trace::event_arg(event, "span_id", span)) captured.push_back(make_pair(trace, span));
+            if(event.phase == 'B' && event.name != "request" && trace::event_arg(event, "trace_id", trace) && trace::event_arg(event, "span_id", span)
+                && trace::event_arg(event, "parent_id", parent)) adopted.push_back({ trace, span, parent });
+        }
+    }
+    file.close();
+    unlink(path.c_str());
+    size_t linked = 0, unmatched = 0;
+    for(size_t i=0; i+1<captured.size() && i+1<adopted.size(); i+=2) //Request then handler, per request
+    {
+        double root = captured[i].second;
+        bool handler = captured[i].first == root && adopted[i][0] == root && adopted[i][2] == captured[i].second;
+        bool task = captured[i+1].first == root && captured[i+1].second == adopted[i][1] && adopted[i+1][0] == root && adopted[i+1][2] == adopted[i][1];
+        if(handler && task && (i == 0 || root != captured[i-2].second)) linked++;
+    }
+    for(auto const& flow : flows) if(flow.second != 0) unmatched++;
+    report("context", linked == requests && flows.size() == 2 * requests && unmatched == 0,
+        to_string(linked) + " of " + to_string(requests) + " requests linked, " + to_string(flows.size()) + " flows, " + to_string(unmatched) + " unmatched");
+}
+
+static void count_hits(int times)
+{
+    for(int i=0; i<times; i++) TRACE_COUNT("check_hit");
+}
+
+static void check_hits(const string& directory)
+{
+    string path = directory + "/trace_check_hits.json";
+    count_hits(500); //Before the session, so not counted
+    if(!trace::trace_start(path.c_str()))
+    {
+        report("hits", false, "unable to start");
+        return;
+    }
+    const int threads = 4, hits = 10000;
+    vector<thread> workers;
+    for(int w=0; w<threads; w++) workers.emplace_back(count_hits, hits);
+    for(thread& worker : workers) worker.join();
+    trace::trace_flush();
+    count_hits(1000);
+    trace::trace_end();
+
+    vector<double> counts;
+    trace::TraceFile file;
+    if(file.open(path.c_str()))
+    {
+        double value;
+        for(const trace::TraceEvent& event : file) if(event.phase == 'C' && event.name == "check_hit" && trace::event_arg(event, "value", value)) counts.push_back(value);
+    }
+    file.close();
+    unlink(path.c_str());
+    double flushed = threads * hits, ended = flushed + 1000;
+    bool right = counts.size() == 2 && counts[0] == flushed && counts[1] == ended;
+    string written;
+    for(double count : counts) written += (written.empty() ? "" : ", ") + to_string(int64_t(count));
+    report("hits", right, "counts " + (written.empty() ? string("none") : written) + " written, expected " + to_string(int64_t(flushed)) + ", " + to_string(int64_t(ended)));
+}
+
+static void check_reserve(const string& directory)
+{
+    string path = directory + "/trace_check_reserve.json";
+    if(!trace::trace_start(path.c_str()))
+    {
+        report("reserve", false, "unable to start");
+        return;
+    }
+    future<bool> ended = async(launch::async, []
+    {
+        trace::TraceReservation reservation = trace::trace_reserve(4);
+        bool filled = reservation.event_start("reserved", "check") && reservation.event_end();
+        trace::trace_end(); //The reservation is still open
+        return filled && !reservation.instant("after");
+    });
+    if(ended.wait_for(chrono::seconds(10)) != future_status::ready)
+    {
+        report("reserve", false, "trace_end did not return");
+        fflush(stdout);
+        _exit(1); //The thread never finishes
+    }
+    bool refused = ended.get();
+    string text = read_file(path);
+    bool kept = text.find("\"reserved\"") != string::npos && text.find("\"after\"") == string::npos;
+    unlink(path.c_str());
+    report("reserve", refused && kept, string(kept ? "events kept" : "events lost") + (refused ? "" : ", filled after trace_end"));
+}
+
+static void check_strings(const string& directory)
+{
+    string path = directory + "/trace_check_strings.json";
+    trace::trace_set_buffer_size(100);
+    if(!trace::trace_start(path.c_str()))
+    {
+        report("strings", false, "unable to start");
+        return;
+    }
+    char name[32], categories[32];
+    for(int i=0; i<1000; i++)
+    {
+        snprintf(name, sizeof(name), "task %d", i % 10);
+        snprintf(categories, sizeof(categories), "group %d", i % 10);
+        trace::trace_event_start(name, categories);
+        trace::trace_counter_int(name, i);
+        trace::trace_event_end();
+        strcpy(name, "overwritten");
+        strcpy(categories, "overwritten");
+    }
+    trace::trace_end();
+    trace::trace_set_buffer_size(trace::TRACE_MAX);
+
+    string text = read_file(path);
+    size_t wrong = 0;
+    for(int i=0; i<10; i++)
+    {
+        string span = "{\"name\": \"task " + to_string(i) + "\", \"cat\": \"group " + to_string(i) + "\"";
+        size_t spans = 0;
+        for(size_t at = text.find(span); at != string::npos; at = text.find(span, at + 1)) spans++;
+        if(spans != 100) wrong++;
+    }
+    bool overwritten = text.find("overwritten") != string::npos;
+    unlink(path.c_str());
+    report("strings", wrong == 0 && !overwritten, to_string(wrong) + " of 10 names miscounted" + (overwritten ? ", overwritten text written" : ""));
+}
+
+static void check_filter(const string& directory)
+{
+    string path = directory + "/trace_check_filter.json";
+    trace::trace_set_buffer_size(100);
+    if(!trace::trace_start(path.c_str()))
+    {
+        report("filter", false, "unable to start");
+        return;
+    }
+    for(int i=0; i<20000; i++)
+    {
+        unsigned int tid = 1 + i / 500 % 4; //Runs of one tid, so a chunk holds a few of them
+        trace::trace_event_start(i % 3 ? "a" : "b", "check", tid);
+        trace::trace_event_end(tid);
+        if(i % 1000 == 999) trace::trace_flush();
+    }
+    trace::trace_end();
+    trace::trace_set_buffer_size(trace::TRACE_MAX);
+
+    trace::TraceFile file;
+    bool opened = file.open(path.c_str());
+    size_t chunks = file.index().size();
+    trace::TraceFilter filter;
+    filter.names.push_back("b");
+    filter.tids.push_back(3);
+    filter.metadata = false;
+    size_t expected = 0, found = 0;
+    if(opened)
+    {
+        vector<double> times;
+        for(const trace::TraceEvent& event : file) if(event.ts != trace::NO_TIMESTAMP) times.push_back(event.ts);
+        if(!times.empty())
+        {
+            filter.from = times[times.size() / 3];
+            filter.to = times[times.size() * 2 / 3];
+        }
+        for(const trace::TraceEvent& event : file)
+        {
+            if(event.name == "b" && event.tid == 3 && event.ts >= filter.from && event.ts <= filter.to) expected++;
+        }
+        found = file.events(filter).size();
+    }
+    file.close();
+    unlink(path.c_str());
+    report("filter", opened && chunks > 1 && expected > 0 && found == expected,
+        to_string(found) + " of " + to_string(expected) + " events found, " + to_string(chunks) + " chunks");
+}
+
+__attribute__((noinline)) static void stack_inner(int depth)
+{
+    if(depth > 0) stack_inner(depth - 1);
+    else trace::trace_instant_global("stacked");
+    asm volatile(""); //Keeps the recursion from becoming a loop
+}
+
+static void check_stack(const string& directory)
+{
+    string path = directory + "/trace_check_stack.json";
+    trace::trace_set_stack_capture("stacked");
+    if(!trace::trace_start(path.c_str()))
+    {
+        trace::trace_set_stack_capture("stacked", false);
+        report("stack", false, "unable to start");
+        return;
+    }
+    stack_inner(5);
+    trace::trace_end();
+    trace::trace_set_stack_capture("stacked", false);
+
+    string text = read_file(path);
+    size_t at = text.find("\"stack\": [");
+    size_t frames = 0, empty = 0;
+    if(at != string::npos)
+    {
+        size_t end = text.find(']', at);
+        for(size_t quote = text.find('"', at + 10); quote < end; quote = text.find('"', quote + 1))
+        {
+            size_t close = text.find('"', quote + 1);
+            if(close == quote + 1) empty++;
+            frames++;
+            quote = close;
+        }
+    }
+    unlink(path.c_str());
+    report("stack", frames >= 7 && frames < 64 && empty == 0, to_string(frames) + " frames" + (empty ? ", some empty" : ""));
+}
+
+static void signal_handler(int)
+{
+    trace::trace_signal_event_start("handler", "check");
+    trace::trace_signal_instant("signalled");
+    trace::trace_signal_event_end();
+}
+
+static void check_signal(const string& directory)
+{
+    const int threads = 4, spans = 10000, every = 50; //Two or three flushes
+    string path = directory + "/trace_check_signal.json";
+    trace::trace_set_buffer_size(100);
+    struct sigaction action = {}, previous;
+    action.sa_handler = signal_handler;
+    sigaction(SIGUSR1, &action, &previous);
+    if(!trace::trace_start(path.c_str()))
+    {
+        sigaction(SIGUSR1, &previous, nullptr);
+        report("signal", false, "unable to start");
+        return;
+    }
+    vector<thread> workers;
+    for(int t=0; t<threads; t++)
+    {
+        workers.emplace_back([]
+        {
+            trace::trace_signal_prepare(4096); //A ring left by a thread that exited is reused undrained
+            for(int i=0; i<spans; i++)
+            {
+                trace::trace_event_start("outer", "check");
+                if(i % every == 0) raise(SIGUSR1);
+                trace::trace_event_end();
+            }
+        });
+    }
+    for(auto& worker : workers) worker.join();
+    trace::trace_end();
+    sigaction(SIGUSR1, &previous, nullptr);
+    trace::trace_set_buffer_size(trace::TRACE_MAX);
+
+    string text = read_file(path);
+    size_t records, signalled = 0;
+    size_t back = out_of_order(text, records);
+    for(size_t at = text.find("\"signalled\""); at != string::npos; at = text.find("\"signalled\"", at + 1)) signalled++;
+    unlink(path.c_str());
+    size_t expected = threads * (spans / every);
+    report("signal", back == 0 && signalled == expected,
+        to_string(signalled) + " of " + to_string(expected) + " signals, " + to_string(back) + " of " + to_string(records) + " timestamps out of order");
+}
+
+static string overhead_args(const string& path) //The tracelib_overhead record's args, or ""
+{
+    string text = read_file(path);
+    unlink(path.c_str());
+    size_t at = text.find("\"tracelib_overhead\"");
+    if(at == string::npos) return "";
+    at = text.find("\"span_ns\"", at);
+    return at == string::npos ? "" : text.substr(at, text.find('}', at) - at);
+}
+
+static void check_calibrate(const string& directory)
+{
+    vector<string> args;
+    for(int i=0; i<3; i++)
+    {
+        string path = directory + "/trace_check_calibrate" + to_string(i) + ".json";
+        trace::Tracer other;
+        trace::Tracer& tracer = i == 1 ? other : trace::defaultTracer;
+        if(!tracer.start(path.c_str()))
+        {
+            report("calibrate", false, "unable to start");
+            return;
+        }
+        tracer.end();
+        args.push_back(overhead_args(path));
+    }
+    bool same = !args[0].empty() && args[1] == args[0] && args[2] == args[0];
+    report("calibrate", same, same ? args[0] : "overheads " + args[0] + " / " + args[1] + " / " + args[2]);
+}
+
+static string run_tool(const string& command) //Output of a command, e.g. one of the built tools
+{
+    string output;
+    FILE* pipe = popen(command.c_str(), "r");
+    if(!pipe) return output;
+    char buffer[4096];
+    size_t length;
+    while((length = fread(buffer, 1, sizeof(buffer), pipe)) > 0) output.append(buffer, length);
+    pclose(pipe);
+    return output;
+}
+
+static void check_parallel(const string& directory)
+{
+    string path = directory + "/trace_check_parallel.json";
+    ofstream trace(path);
+    trace << "[\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": { \"name\": \"check\"} }";
+    for(int tid=1; tid<=4; tid++) //Four at once over 0..100, then four in turn over 100..500
+    {
+        trace << ",\n{\"name\": \"together\", \"cat\": \"check\", \"ph\": \"B\", \"pid\": 1, \"tid\": " << tid << ", \"ts\": 0}";
+        trace << ",\n{\"ph\": \"E\", \"pid\": 1, \"tid\": " << tid << ", \"ts\": 100}";
+        trace << ",\n{\"name\": \"turns\", \"cat\": \"check\", \"ph\": \"B\", \"pid\": 1, \"tid\": " << tid << ", \"ts\": " << tid * 100 << "}";
+        trace << ",\n{\"ph\": \"E\", \"pid\": 1, \"tid\": " << tid << ", \"ts\": " << tid * 100 + 100 << "}";
+    }
+    trace << "\n]\n";
+    trace.close();
+
+    string output = run_tool("./trace_analyze --concurrency " + path + " 2>&1");
+    unlink(path.c_str());
+    int most[2] = { 0, 0 };
+    double active[2] = { 0, 0 };
+    const char* names[2] = { "together", "turns" };
+    size_t table = output.find("\nconcurrency");
+    for(int n=0; n<2 && table != string::npos; n++)
+    {
+        size_t row = output.find(string("\n") + names[n] + " ", table);
+        double window;
+        if(row != string::npos) sscanf(output.c_str() + row + 1 + strlen(names[n]), "%i %lf %lf", &most[n], &window, &active[n]);
+    }
+    bool right = most[0] == 4 && fabs(active[0] - 4) < 0.01 && most[1] == 1 && fabs(active[1] - 1) < 0.01;
+    char detail[128];
+    snprintf(detail, sizeof(detail), "together %i at most, %.3f on average; turns %i at most, %.3f on average", most[0], active[0], most[1], active[1]);
+    report("parallel", right, table == string::npos ? "no concurrency table from ./trace_analyze" : detail);
+}
+
+static void check_window(const string& directory)
+{
+    string path = directory + "/trace_check_window.json", output = directory + "/trace_check_window_out.json";
+    struct Span { const char* name; int tid; int from, to; }; //Microseconds after the first event, to -1 if never ended
+    const Span spans[] = { {"outer", 1, 0, 10000}, {"before", 1, 100, 1000}, {"inside", 1, 3000, 4000},
+        {"crossing_in", 2, 1000, 5000}, {"crossing_out", 3, 5000, 9000}, {"unfinished", 4, 3000, -1} };
+    vector<pair<int, string>> lines; //Events by time
+    const int base = 1000000;
+    for(const Span& span : spans)
+    {
+        lines.push_back(make_pair(span.from, "{\"name\": \"" + string(span.name) + "\", \"cat\": \"check\", \"ph\": \"B\", \"pid\": 1, \"tid\": "
+            + to_string(span.tid) + ", \"ts\": " + to_string(base + span.from) + "}"));
+        if(span.to >= 0) lines.push_back(make_pair(span.to, "{\"ph\": \"E\", \"pid\": 1, \"tid\": " + to_string(span.tid) + ", \"ts\": " + to_string(base + span.to) + "}"));
+    }
+    stable_sort(lines.begin(), lines.end(), [](const pair<int, string>& a, const pair<int, string>& b){ return a.first < b.first; });
+    ofstream trace(path);
+    trace << "[\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": { \"name\": \"check\"} }";
+    for(auto const& line : lines) trace << ",\n" << line.second;
+    trace << "\n]\n";
+    trace.close();
+
+    run_tool("./trace_lod --window 2 6 " + output + " " + path + " 2>&1");
+    unlink(path.c_str());
+    map<int, int> open; //Starts less ends by tid
+    size_t starts = 0, closed = 0;
+    bool before = false;
+    trace::TraceFile file;
+    bool opened = file.open(output.c_str());
+    for(const trace::TraceEvent& event : file)
+    {
+        if(event.phase == 'B') open[event.tid]++, starts++;
+        if(event.phase == 'E') open[event.tid]--;
+        if(event.phase == 'E' && event.tid == 4 && event.ts == base + 6000) closed++;
+        if(event.name == "before") before = true;
+    }
+    file.close();
+    unlink(output.c_str());
+    size_t unmatched = 0;
+    for(auto const& thread : open) if(thread.second != 0) unmatched++;
+    report("window", opened && starts == 5 && unmatched == 0 && closed == 1 && !before,
+        !opened ? "no output from ./trace_lod" : to_string(starts) + " of 5 spans kept, " + to_string(unmatched) + " threads unmatched"
+        + (closed == 1 ? "" : ", unfinished span not closed at the edge") + (before ? ", span before the window kept" : ""));
+}
+
+static void check_kernel(const string& directory)
+{
+    string path = directory + "/trace_check_kernel.json", kernel = directory + "/trace_check_kernel.txt", output = directory + "/trace_check_kernel_out.json";
+    ofstream trace(path);
+    trace << "[\n{\"name\": \"work\", \"cat\": \"check\", \"ph\": \"B\", \"pid\": 4242, \"tid\": 1, \"ts\": 1000100.000}";
+    trace << ",\n{\"ph\": \"E\", \"pid\": 4242, \"tid\": 1, \"ts\": 1000500.000}\n]\n";
+    trace.close();
+    //Woken at 50us, runs 80-300, preempted until 400, runs 400-600 and sleeps
+    ofstream lines(kernel);
+    lines << "# tracer: nop\n";
+    lines << "     kworker-10    [000] d..3 1.000050: sched_wakeup: comm=worker pid=5001 prio=120 target_cpu=000\n";
+    lines << "     kworker-10    [000] d..3 1.000080: sched_switch: prev_comm=kworker prev_pid=10 prev_prio=120 prev_state=S ==> next_comm=worker next_pid=5001 next_prio=120\n";
+    lines << "      worker-5001  [000] .... 1.000100: tracing_mark_write: B|4242|work\n";
+    lines << "      worker-5001  [000] d..3 1.000300: sched_switch: prev_comm=worker prev_pid=5001 prev_prio=120 prev_state=R ==> next_comm=other next_pid=20 next_prio=120\n";
+    lines << "       other-20    [000] d..3 1.000400: sched_switch: prev_comm=other prev_pid=20 prev_prio=120 prev_state=S ==> next_comm=worker next_pid=5001 next_prio=120\n";
+    lines << "      worker-5001  [000] .... 1.000500: tracing_mark_write: E|4242\n";
+    lines << "      worker-5001  [000] d..3 1.000600: sched_switch: prev_comm=worker prev_pid=5001 prev_prio=120 prev_state=S ==> next_comm=swapper/0 next_pid=0 next_prio=120\n";
+    lines.close();
+
+    run_tool("./trace_sched " + output + " " + path + " " + kernel + " 2>&1");
+    unlink(path.c_str());
+    unlink(kernel.c_str());
+    double running = 0, runnable = 0; //Microseconds of the worker's slices
+    size_t slices = 0, onCpu = 0, spans = 0;
+    bool labelled = false;
+    trace::TraceFile file;
+    bool opened = file.open(output.c_str());
+    for(const trace::TraceEvent& event : file)
+    {
+        if(event.phase == 'B' && event.name == "work") spans++;
+        if(event.phase == 'X' && event.tid == 5001)
+        {
+            slices++;
+            if(event.name == "running") running += event.dur;
+            if(event.name == "runnable") runnable += event.dur;
+        }
+        if(event.phase == 'X' && event.name != "running" && event.name != "runnable") onCpu++;
+        if(event.name == "thread_name" && event.tid == 5001) labelled = string(event.text, event.length).find("(tracelib tid 1)") != string::npos;
+    }
+    file.close();
+    unlink(output.c_str());
+    bool right = spans == 1 && slices == 4 && fabs(running - 420) < 0.01 && fabs(runnable - 130) < 0.01 && onCpu == 3 && labelled;
+    char detail[160];
+    snprintf(detail, sizeof(detail), "%zu of 4 thread slices, %.0f of 420us running, %.0f of 130us runnable, %zu of 3 CPU slices%s",
+        slices, running, runnable, onCpu, labelled ? "" : ", thread not matched to tid 1");
+    report("kernel", right, opened ? detail : "no output from ./trace_sched");
+}
+
+int main(int argc, char** argv)
+{
+    string directory = argc > 1 ? argv[1] : "/tmp";
+    check_writer(directory);
+    check_compress(directory);
+    check_jsonl(directory);
+    check_shm(directory);
+    check_order(directory, 0);
+    check_order(directory, 64 << 10);
+    check_process(directory);
+    check_tracers(directory);
+    check_counter(directory);
+    check_elided(directory);
+    check_points(directory);
+    check_sched(directory);
+    check_context(directory);
+    check_hits(directory);
+    check_reserve(directory);
+    check_strings(directory);
+    check_filter(directory);
+    check_stack(directory);
+    check_signal(directory);
+    check_calibrate(directory);
+    check_parallel(directory);
+    check_window(directory);
+    check_kernel(directory);
+    return failures > 0;
+}
@@ -0,0 +1,176 @@
+/*
+    trace_collector [shm-name...]
+
+    Drains the shared-memory rings of processes traced with TRACE_WRITER_SHM into the trace
+    files they name, so the traced processes never touch a file themselves. With no names it
+    takes every /dev/shm/tracelib.* object, waiting for one to appear if there is none yet.
+
+    Exits once every ring is drained and its writer has either finished or died. Whatever
+    reached the ring before a writer was killed is still written out, and the JSON array is
+    closed for it so the file parses. A writer drops whole appends while its ring is full and
+    no collector is attached; how many is reported at the end.
+*/
+#include "tracelib.h"
+#include <dirent.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+struct Attached
+{
+    string name;
+    trace::ShmHeader* shm;
+    size_t bytes;
+    int output;
+    uint64_t offset; //Bytes written to output
+    bool array; //Stream opened with '['
+    char last; //Last non-whitespace byte written
+};
+
+static bool attach(const string& name, Attached& a)
+{
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if(fd < 0)
+    {
+        cerr << "Error: Unable to open shared memory \"" << name << "\".\n";
+        return false;
+    }
+    struct stat info;
+    void* memory = MAP_FAILED;
+    for(int tries=0; tries<1000; tries++) //The writer may still be sizing it
+    {
+        if(fstat(fd, &info) == 0 && size_t(info.st_size) > offsetof(trace::ShmHeader, ring))
+        {
+            memory = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            break;
+        }
+        usleep(1000);
+    }
+    close(fd);
+    if(memory == MAP_FAILED)
+    {
+        cerr << "Error: Unable to map shared memory \"" << name << "\".\n";
+        return false;
+    }
+    a.name = name;
+    a.shm = (trace::ShmHeader*)memory;
+    a.bytes = info.st_size;
+    for(int tries=0; tries<1000 && a.shm->magic != trace::SHM_MAGIC; tries++) usleep(1000);
+    atomic_thread_fence(memory_order_acquire);
+    if(a.shm->magic != trace::SHM_MAGIC || a.shm->version != trace::SHM_VERSION)
+    {
+        cerr << "Error: \"" << name << "\" is not a tracelib ring.\n";
+        munmap(memory, a.bytes);
+        return false;
+    }
+    a.output = open(a.shm->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(a.output < 0)
+    {
+        cerr << "Error: Unable to open file \"" << a.shm->path << "\" for trace output.\n";
+        munmap(memory, a.bytes);
+        return false;
+    }
+    a.offset = 0;
+    a.array = false;
+    a.last = 0;
+    a.shm->collectorPid.store(getpid());
+    cout << "Collecting pid " << a.shm->pid << " into " << a.shm->path << "\n";
+    return true;
+}
+
+static void write_out(Attached& a, const char* data, size_t length)
+{
+    for(size_t i=0; i<length; i++)
+    {
+        if(data[i] == ' ' || data[i] == '\n') continue;
+        if(a.last == 0 && data[i] == '[') a.array = true;
+        a.last = data[i];
+    }
+    struct iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len = length;
+    if(!trace::trace_pwrite_all(a.output, &iov, 1, a.offset))
+    {
+        cerr << "Error: Unable to write trace output to \"" << a.shm->path << "\".\n";
+    }
+    a.offset += length;
+}
+
+static bool drain(Attached& a)
+{
+    uint64_t read = a.shm->readPos.load(memory_order_relaxed);
+    uint64_t write = a.shm->writePos.load(memory_order_acquire);
+    if(read == write) return false;
+    uint64_t mask = a.shm->capacity - 1;
+    size_t length = size_t(write - read);
+    size_t first = min<size_t>(length, a.shm->capacity - (read & mask));
+    write_out(a, a.shm->ring + (read & mask), first);
+    write_out(a, a.shm->ring, length - first);
+    a.shm->readPos.store(write, memory_order_release);
+    return true;
+}
+
+static void finish(Attached& a, bool died)
+{
+    if(a.array && a.last != ']') write_out(a, "\n]", 2); //Writer never reached trace_end, or its end was dropped
+    uint64_t dropped = a.shm->dropped.load();
+    if(dropped)
+    {
+        cerr << "Warning: pid " << a.shm->pid << " dropped " << a.shm->droppedAppends.load() << " appends ("
+            << dropped << " bytes) while its ring was full.\n";
+    }
+    cout << "Finished pid " << a.shm->pid << (died ? " (writer died)" : "") << "\n";
+    close(a.output);
+    munmap(a.shm, a.bytes);
+    shm_unlink(a.name.c_str());
+}
+
+static vector<string> find_rings()
+{
+    vector<string> names;
+    DIR* directory = opendir("/dev/shm");
+    if(!directory) return names;
+    while(struct dirent* entry = readdir(directory))
+    {
+        if(strncmp(entry->d_name, "tracelib.", 9) == 0) names.push_back(string("/") + entry->d_name);
+    }
+    closedir(directory);
+    return names;
+}
+
+int main(int argc, char** argv)
+{
+    vector<string> names(argv + 1, argv + argc);
+    while(names.empty())
+    {
+        names = find_rings();
+        if(names.empty()) usleep(10000);
+    }
+
+    vector<Attached> rings;
+    for(auto const& name : names)
+    {
+        Attached a;
+        if(attach(name, a)) rings.push_back(a);
+    }
+
+    while(!rings.empty())
+    {
+        bool progress = false;
+        for(size_t i=0; i<rings.size(); )
+        {
+            Attached& a = rings[i];
+            bool done = a.shm->state.load(memory_order_acquire) == trace::SHM_DONE;
+            bool died = !done && kill(a.shm->pid, 0) != 0 && errno == ESRCH;
+            progress |= drain(a);
+            if(done || died)
+            {
+                finish(a, died);
+                rings.erase(rings.begin() + i);
+            }
+            else i++;
+        }
+        if(!progress) usleep(1000);
+    }
+    return 0;
+}
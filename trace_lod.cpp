@@ -0,0 +1,309 @@
+/*
+    trace_lod [--max-events N] overview.json input.json...
+    trace_lod --window start_ms end_ms output.json input.json...
+
+    Level-of-detail views of traces too big for the viewer.
+
+    The first form builds a pyramid of the spans in the inputs: level 0 splits the trace into
+    LOD_BUCKETS buckets of time, and every level above halves the number of buckets. Each
+    cell holds, for one thread, span name and bucket, how many spans started in it and how
+    much time they covered in it. The finest level with at most --max-events cells (100000 by
+    default) is written as the overview: one complete ("X") event per cell, starting at the
+    bucket and as long as the time covered, with the count and total in its args. Within a
+    bucket the cells of a thread all start together, so they stack by duration.
+
+    The second form copies every event between start_ms and end_ms, in milliseconds from the
+    first event as the viewer shows them, plus the starts and ends of the spans that cross the
+    window's edges so they stay matched. For traces with a chunk index (uncompressed tracelib
+    output) only the chunks overlapping the window, and those holding metadata such as thread
+    names, are read, so the time taken depends on the window and not the file; a span that
+    started in a chunk not read is left out, and one whose end was not read is closed at the
+    end of the window.
+*/
+#include "tracereader.h"
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <cstdio>
+#include <cfloat>
+
+using namespace std;
+
+const size_t LOD_BUCKETS = 4096; //Buckets in level 0 of the pyramid
+
+struct Cell
+{
+    size_t count = 0;
+    double total = 0; //Microseconds covered in the bucket
+};
+
+typedef pair<int, size_t> CellKey; //Track index, bucket
+typedef map<CellKey, Cell> Level;
+
+struct Track
+{
+    int pid;
+    int tid;
+    string name;
+};
+
+/*
+    bool read_events(files, names, events, windowed, start, end)
+
+    Opens the files and reads their events, sorted by timestamp. With windowed, files with a
+    chunk index are only read in the chunks that overlap start..end, which are then made
+    absolute by adding the first timestamp of all the files, and in those holding metadata.
+*/
+static bool read_events(vector<trace::TraceFile>& files, const vector<const char*>& names, vector<trace::TraceEvent>& events, bool windowed, double& start, double& end)
+{
+    double origin = DBL_MAX;
+    for(size_t i=0; i<files.size(); i++)
+    {
+        if(!files[i].open(names[i])) return false;
+        for(auto const& chunk : files[i].index()) origin = min(origin, chunk.first);
+        if(windowed && !files[i].index().empty()) continue;
+        vector<trace::TraceEvent> all = files[i].events();
+        events.insert(events.end(), all.begin(), all.end());
+    }
+    for(const trace::TraceEvent& e : events)
+    {
+        if(e.ts != trace::NO_TIMESTAMP) origin = min(origin, e.ts);
+    }
+    start += origin;
+    end += origin;
+    for(size_t i=0; windowed && i<files.size(); i++)
+    {
+        if(files[i].index().empty()) continue;
+        trace::TraceFilter filter; //The overlapping chunks whole, so spans crossing the start stay matched
+        filter.from = DBL_MAX;
+        filter.to = -DBL_MAX;
+        for(auto const& chunk : files[i].index())
+        {
+            if(chunk.last < start || chunk.first > end) continue;
+            filter.from = min(filter.from, chunk.first);
+            filter.to = max(filter.to, chunk.last);
+        }
+        vector<trace::TraceEvent> found = files[i].events(filter);
+        events.insert(events.end(), found.begin(), found.end());
+    }
+    //Several files interleave in time
+    stable_sort(events.begin(), events.end(),
+        [](const trace::TraceEvent& a, const trace::TraceEvent& b){ return a.ts < b.ts; });
+    return true;
+}
+
+static void write_event(FILE* output, const trace::TraceEvent& event, size_t& written)
+{
+    if(trace::event_is_index(event)) return;
+    fputs(written++ ? ",\n" : "[\n", output);
+    fwrite(event.text, 1, event.length, output);
+}
+
+/*
+    int overview(output, events, maxEvents)
+
+    Builds the pyramid and writes the finest level that fits in maxEvents events.
+*/
+static int overview(const char* output, const vector<trace::TraceEvent>& events, size_t maxEvents)
+{
+    double first = DBL_MAX, last = -DBL_MAX;
+    for(const trace::TraceEvent& e : events)
+    {
+        if(e.ts == trace::NO_TIMESTAMP) continue;
+        first = min(first, e.ts);
+        last = max(last, e.ts);
+    }
+    if(first > last)
+    {
+        cerr << "Error: No timed events in the input.\n";
+        return 1;
+    }
+    double width = max((last - first) / LOD_BUCKETS, 0.001);
+
+    //Level 0 from the spans, each one spread over the buckets it covers
+    vector<Track> tracks;
+    map<pair<pair<int, int>, string>, int> trackIndex;
+    map<pair<int, int>, vector<pair<int, double>>> open; //Track and start of the open spans, by thread
+    vector<Level> levels(1);
+    auto add_span = [&](int track, double start, double end)
+    {
+        size_t bucket = min(LOD_BUCKETS - 1, size_t((start - first) / width));
+        levels[0][CellKey(track, bucket)].count++;
+        for(double t = start; t < end; bucket++)
+        {
+            double stop = bucket + 1 < LOD_BUCKETS ? min(end, first + (bucket + 1) * width) : end;
+            if(stop > t) levels[0][CellKey(track, bucket)].total += stop - t;
+            t = max(t, stop);
+            if(bucket + 1 >= LOD_BUCKETS) break; //The last bucket took the rest
+        }
+    };
+    for(const trace::TraceEvent& e : events)
+    {
+        pair<int, int> thread(e.pid, e.tid);
+        if(e.phase == 'B' || e.phase == 'X')
+        {
+            auto key = make_pair(thread, e.name.str());
+            auto found = trackIndex.find(key);
+            int track = found != trackIndex.end() ? found->second : int(tracks.size());
+            if(found == trackIndex.end())
+            {
+                trackIndex[key] = track;
+                tracks.push_back(Track{e.pid, e.tid, key.second});
+            }
+            if(e.phase == 'X') add_span(track, e.ts, e.ts + e.dur);
+            else if(e.phase == 'B') open[thread].push_back(make_pair(track, e.ts));
+        }
+        else if(e.phase == 'E' && !open[thread].empty())
+        {
+            add_span(open[thread].back().first, open[thread].back().second, e.ts);
+            open[thread].pop_back();
+        }
+    }
+
+    //Every level above merges pairs of buckets
+    while(levels.back().size() > 1 && (LOD_BUCKETS >> (levels.size() - 1)) > 1)
+    {
+        Level next;
+        for(auto const& cell : levels.back())
+        {
+            Cell& merged = next[CellKey(cell.first.first, cell.first.second / 2)];
+            merged.count += cell.second.count;
+            merged.total += cell.second.total;
+        }
+        levels.push_back(next);
+    }
+
+    printf("%6s %14s %10s\n", "level", "bucket us", "cells");
+    for(size_t i=0; i<levels.size(); i++) printf("%6zu %14.3f %10zu\n", i, width * (1 << i), levels[i].size());
+    size_t chosen = 0;
+    while(chosen + 1 < levels.size() && levels[chosen].size() > maxEvents) chosen++;
+
+    FILE* file = fopen(output, "w");
+    if(!file)
+    {
+        cerr << "Error: Unable to open file \"" << output << "\" for the overview.\n";
+        return 1;
+    }
+    size_t written = 0;
+    for(const trace::TraceEvent& e : events)
+    {
+        if(e.phase == 'M') write_event(file, e, written); //Process and thread names
+    }
+    double bucket = width * (1 << chosen);
+    for(auto const& cell : levels[chosen])
+    {
+        const Track& track = tracks[cell.first.first];
+        fputs(written++ ? ",\n" : "[\n", file);
+        fprintf(file, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %i, \"tid\": %i, \"ts\": %.3f, \"dur\": %.3f, \"args\": { \"count\": %zu, \"total_us\": %.3f} }",
+            track.name.c_str(), track.pid, track.tid, first + cell.first.second * bucket,
+            min(cell.second.total, bucket), cell.second.count, cell.second.total);
+    }
+    fputs(written ? "\n]" : "[\n]", file);
+    fclose(file);
+    cout << "Wrote level " << chosen << " (" << levels[chosen].size() << " cells) to " << output << "\n";
+    return 0;
+}
+
+/*
+    int window(output, events, start, end)
+
+    Copies the events between the timestamps start and end, and the starts and ends of the
+    spans crossing its edges.
+*/
+static int window(const char* output, const vector<trace::TraceEvent>& events, double start, double end)
+{
+    //Starts of the spans open when the window begins, and of those still open when it ends
+    map<pair<int, int>, vector<const trace::TraceEvent*>> open;
+    vector<bool> keep(events.size(), false);
+    size_t i = 0;
+    for(; i<events.size() && events[i].ts < start; i++)
+    {
+        const trace::TraceEvent& e = events[i];
+        keep[i] = e.phase == 'M';
+        if(e.phase == 'B') open[make_pair(e.pid, e.tid)].push_back(&e);
+        else if(e.phase == 'E' && !open[make_pair(e.pid, e.tid)].empty()) open[make_pair(e.pid, e.tid)].pop_back();
+    }
+    for(auto const& thread : open)
+    {
+        for(const trace::TraceEvent* e : thread.second) keep[e - &events[0]] = true;
+    }
+    map<pair<int, int>, int> depth; //Spans left open within the window that still need an end
+    for(auto const& thread : open) depth[thread.first] = int(thread.second.size());
+    for(; i<events.size() && events[i].ts <= end; i++)
+    {
+        const trace::TraceEvent& e = events[i];
+        int& d = depth[make_pair(e.pid, e.tid)];
+        keep[i] = e.phase != 'E' || d > 0; //Leaves out ends whose start was not read
+        if(e.phase == 'B') d++;
+        else if(e.phase == 'E' && d > 0) d--;
+    }
+    map<pair<int, int>, int> later; //Spans opened after the window, still open
+    for(; i<events.size(); i++) //Ends of the spans still open
+    {
+        const trace::TraceEvent& e = events[i];
+        pair<int, int> thread(e.pid, e.tid);
+        if(e.phase == 'B') later[thread]++;
+        else if(e.phase == 'E' && later[thread] > 0) later[thread]--;
+        else if(e.phase == 'E' && depth[thread] > 0)
+        {
+            keep[i] = true;
+            depth[thread]--;
+        }
+    }
+
+    FILE* file = fopen(output, "w");
+    if(!file)
+    {
+        cerr << "Error: Unable to open file \"" << output << "\" for the window.\n";
+        return 1;
+    }
+    size_t written = 0;
+    for(size_t j=0; j<events.size(); j++)
+    {
+        if(keep[j]) write_event(file, events[j], written);
+    }
+    for(auto const& thread : depth) //Ends not read, or never written, are closed at the edge
+    {
+        for(int d=0; d<thread.second; d++)
+        {
+            fputs(written++ ? ",\n" : "[\n", file);
+            fprintf(file, "{\"ph\": \"E\", \"pid\": %i, \"tid\": %i, \"ts\": %.3f}", thread.first.first, thread.first.second, end);
+        }
+    }
+    fputs(written ? "\n]" : "[\n]", file);
+    fclose(file);
+    cout << "Wrote " << written << " events to " << output << "\n";
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    size_t maxEvents = 100000;
+    bool windowed = false;
+    double start = 0, end = 0;
+    vector<const char*> files;
+    for(int i=1; i<argc; i++)
+    {
+        if(strcmp(argv[i], "--max-events") == 0 && i+1 < argc) maxEvents = strtoul(argv[++i], nullptr, 10);
+        else if(strcmp(argv[i], "--window") == 0 && i+2 < argc)
+        {
+            windowed = true;
+            start = atof(argv[++i]) * 1000;
+            end = atof(argv[++i]) * 1000;
+        }
+        else files.push_back(argv[i]);
+    }
+    if(files.size() < 2)
+    {
+        cerr << "Usage: " << argv[0] << " [--max-events N] overview.json input.json...\n";
+        cerr << "       " << argv[0] << " --window start_ms end_ms output.json input.json...\n";
+        return 1;
+    }
+
+    const char* output = files[0];
+    files.erase(files.begin());
+    vector<trace::TraceFile> inputs(files.size()); //Hold the text the events point into
+    vector<trace::TraceEvent> events;
+    if(!read_events(inputs, files, events, windowed, start, end)) return 1;
+    return windowed ? window(output, events, start, end) : overview(output, events, maxEvents);
+}
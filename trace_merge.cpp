@@ -0,0 +1,75 @@
+/*
+    trace_merge output.json input.json...
+
+    Combines the trace files written by several processes into one timeline. tracelib
+    stamps events with the real pid and CLOCK_MONOTONIC, so the inputs share one clock and
+    can simply be merged by timestamp. Metadata events (process names) come first.
+*/
+#include "tracereader.h"
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+    if(argc < 3)
+    {
+        cerr << "Usage: " << argv[0] << " output.json input.json...\n";
+        return 1;
+    }
+
+    int inputs = argc - 2;
+    vector<trace::TraceFile> files(inputs);
+    vector<vector<trace::TraceEvent>> streams(inputs);
+    for(int i=0; i<inputs; i++)
+    {
+        if(!files[i].open(argv[i+2])) return 1;
+        streams[i] = files[i].events();
+        //Usually in time order already (see TraceFile); the merge needs it exact
+        auto earlier = [](const trace::TraceEvent& a, const trace::TraceEvent& b){ return a.ts < b.ts; };
+        if(!is_sorted(streams[i].begin(), streams[i].end(), earlier)) stable_sort(streams[i].begin(), streams[i].end(), earlier);
+    }
+
+    FILE* output = fopen(argv[1], "w");
+    if(!output)
+    {
+        cerr << "Error: Unable to open file \"" << argv[1] << "\" for merged output.\n";
+        return 1;
+    }
+
+    typedef pair<double, int> Head; //Timestamp of the next event, input index
+    vector<Head> heap;
+    vector<size_t> next(inputs, 0);
+    for(int i=0; i<inputs; i++)
+    {
+        if(!streams[i].empty()) heap.push_back(Head(streams[i][0].ts, i));
+    }
+    make_heap(heap.begin(), heap.end(), greater<Head>());
+
+    size_t written = 0;
+    fputs("[\n", output);
+    while(!heap.empty())
+    {
+        pop_heap(heap.begin(), heap.end(), greater<Head>());
+        int input = heap.back().second;
+        const trace::TraceEvent& event = streams[input][next[input]++];
+        if(!trace::event_is_index(event))
+        {
+            if(written++) fputs(",\n", output);
+            fwrite(event.text, 1, event.length, output);
+        }
+        if(next[input] < streams[input].size())
+        {
+            heap.back().first = streams[input][next[input]].ts;
+            push_heap(heap.begin(), heap.end(), greater<Head>());
+        }
+        else heap.pop_back();
+    }
+    fputs("\n]", output);
+    fclose(output);
+
+    cout << "Merged " << written << " events from " << inputs << " files into " << argv[1] << "\n";
+    return 0;
+}
@@ -0,0 +1,352 @@
+/*
+    trace_sched [--comm name] output.json trace.json kernel_trace.txt
+
+    Merges the scheduler's view of a run into a tracelib trace. kernel_trace.txt is the text
+    of an ftrace session (/sys/kernel/tracing/trace, or trace-cmd report) with the
+    sched_switch and sched_wakeup events, recorded with trace_clock set to mono so its
+    timestamps are the CLOCK_MONOTONIC ones tracelib uses:
+
+        echo mono > /sys/kernel/tracing/trace_clock
+        echo 1 > /sys/kernel/tracing/events/sched/sched_switch/enable
+        echo 1 > /sys/kernel/tracing/events/sched/sched_wakeup/enable
+        ./Part2   (built with trace_set_kernel_markers(true))
+        cat /sys/kernel/tracing/trace > kernel_trace.txt
+
+    The output has every event of trace.json, plus a "kernel scheduler" process (pid 0) with
+    a track per CPU showing which task ran on it, and a track per thread of the traced
+    process showing when it was running, and when it was runnable but waiting for a CPU,
+    with what woke it. The threads of the traced process are those that wrote tracelib's
+    span markers (see trace_set_kernel_markers), or any task named --comm. Each thread's
+    track is labelled with the tracelib tid whose spans its markers matched.
+*/
+#include "tracereader.h"
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <cstdio>
+#include <cmath>
+
+using namespace std;
+
+const int CPU_TID_BASE = 1 << 22; //Above any kernel thread id, for the CPU tracks
+const double MARKER_MATCH_US = 50; //Furthest a marker is from the tracelib event it mirrors
+
+struct KernelEvent
+{
+    double ts; //Microseconds
+    int cpu;
+    int pid; //Of the task that ran it
+    string comm;
+    string event;
+    string fields;
+};
+
+struct Marker
+{
+    double ts;
+    int tid; //Kernel thread id
+    int tgid;
+    string name;
+};
+
+struct TaskState
+{
+    string comm;
+    double runnable = -1; //Since when it waits for a CPU, or -1
+    string waker;
+    double running = -1; //Since when it runs, or -1
+    int cpu = -1;
+};
+
+struct CpuState
+{
+    int pid = 0;
+    string comm;
+    double since = -1;
+};
+
+/*
+    bool parse_line(line, event)
+
+    Splits one line of ftrace text output: "comm-pid [cpu] flags seconds: event: fields", where
+    comm may hold spaces and "(tgid)" may follow the pid. Output is false for comments and
+    lines in another format.
+*/
+static bool parse_line(const string& line, KernelEvent& event)
+{
+    if(line.empty() || line[0] == '#') return false;
+    size_t open = 0;
+    while((open = line.find('[', open)) != string::npos) //The cpu: digits in brackets
+    {
+        size_t close = line.find(']', open);
+        if(close != string::npos && close > open + 1 && line.find_first_not_of("0123456789", open + 1) == close) break;
+        open++;
+    }
+    if(open == string::npos) return false;
+    string task = line.substr(0, open);
+    size_t last = task.find_last_not_of(' ');
+    if(last == string::npos) return false;
+    task.resize(last + 1);
+    if(task.back() == ')' && task.rfind('(') != string::npos) //Recorded with the tgid option
+    {
+        task.resize(task.rfind('('));
+        task.resize(task.find_last_not_of(' ') + 1);
+    }
+    size_t dash = task.rfind('-');
+    if(dash == string::npos) return false;
+    event.comm = task.substr(task.find_first_not_of(' '), dash - task.find_first_not_of(' '));
+    event.pid = atoi(task.c_str() + dash + 1);
+    event.cpu = atoi(line.c_str() + open + 1);
+
+    //The timestamp is the first token after the cpu that is a number ending in a colon
+    size_t p = line.find(']', open) + 1;
+    while(p < line.size())
+    {
+        size_t begin = line.find_first_not_of(' ', p);
+        if(begin == string::npos) return false;
+        size_t end = line.find(' ', begin);
+        if(end == string::npos) return false;
+        p = end;
+        if(line[end - 1] != ':') continue;
+        char* parsed = nullptr;
+        double seconds = strtod(line.c_str() + begin, &parsed);
+        if(parsed != line.c_str() + end - 1) continue;
+        event.ts = seconds * 1e6;
+        size_t name = line.find_first_not_of(' ', end);
+        size_t colon = name == string::npos ? string::npos : line.find(':', name);
+        if(colon == string::npos) return false;
+        event.event = line.substr(name, colon - name);
+        event.fields = colon + 2 <= line.size() ? line.substr(colon + 2) : "";
+        return true;
+    }
+    return false;
+}
+
+/*
+    string field(fields, key, until)
+
+    The value after "key=" in the event's fields, up to the next space, or up to until for
+    values that may hold spaces, like task names.
+*/
+static string field(const string& fields, const char* key, const char* until = " ")
+{
+    string pattern = string(key) + "=";
+    size_t at = 0;
+    while((at = fields.find(pattern, at)) != string::npos && at > 0 && fields[at - 1] != ' ') at++;
+    if(at == string::npos) return "";
+    at += pattern.size();
+    size_t end = fields.find(until, at);
+    return fields.substr(at, end == string::npos ? string::npos : end - at);
+}
+
+static void write_slice(FILE* output, const char* name, int tid, double start, double end, const string& args)
+{
+    fprintf(output, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %i, \"ts\": %.3f, \"dur\": %.3f, \"args\": { %s} }",
+        name, tid, start, end - start, args.c_str());
+}
+
+static string escaped(const string& text)
+{
+    string out;
+    for(char c : text)
+    {
+        if(c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+int main(int argc, char** argv)
+{
+    vector<const char*> files;
+    set<string> comms;
+    for(int i=1; i<argc; i++)
+    {
+        if(strcmp(argv[i], "--comm") == 0 && i+1 < argc) comms.insert(argv[++i]);
+        else files.push_back(argv[i]);
+    }
+    if(files.size() != 3)
+    {
+        cerr << "Usage: " << argv[0] << " [--comm name] output.json trace.json kernel_trace.txt\n";
+        return 1;
+    }
+
+    trace::TraceFile trace;
+    if(!trace.open(files[1])) return 1;
+    vector<trace::TraceEvent> events = trace.events();
+    set<int> pids;
+    vector<const trace::TraceEvent*> starts; //Span starts, to match with the markers
+    for(const trace::TraceEvent& event : events)
+    {
+        pids.insert(event.pid);
+        if(event.phase == 'B') starts.push_back(&event);
+    }
+    sort(starts.begin(), starts.end(), [](const trace::TraceEvent* a, const trace::TraceEvent* b){ return a->ts < b->ts; });
+
+    ifstream input(files[2]);
+    if(!input.is_open())
+    {
+        cerr << "Error: Unable to open kernel trace \"" << files[2] << "\".\n";
+        return 1;
+    }
+    vector<KernelEvent> kernel;
+    vector<Marker> markers;
+    set<int> threads; //Kernel thread ids of the traced process
+    string line;
+    KernelEvent event;
+    while(getline(input, line))
+    {
+        if(!parse_line(line, event)) continue;
+        if(event.event == "tracing_mark_write" || event.event == "print")
+        {
+            //"B|tgid|name" or "E|tgid", as written by trace_set_kernel_markers
+            size_t bar = event.fields.find('|');
+            if(bar != 1) continue;
+            Marker marker;
+            marker.ts = event.ts;
+            marker.tid = event.pid;
+            marker.tgid = atoi(event.fields.c_str() + 2);
+            size_t name = event.fields.find('|', 2);
+            if(name != string::npos) marker.name = event.fields.substr(name + 1);
+            while(!marker.name.empty() && (marker.name.back() == '\n' || marker.name.back() == ' ')) marker.name.pop_back();
+            if(!pids.count(marker.tgid)) continue;
+            threads.insert(marker.tid);
+            if(event.fields[0] == 'B') markers.push_back(marker);
+        }
+        else if(event.event == "sched_switch" || event.event == "sched_wakeup" || event.event == "sched_wakeup_new")
+        {
+            kernel.push_back(event);
+        }
+    }
+    if(kernel.empty())
+    {
+        cerr << "Error: No sched_switch or sched_wakeup events in \"" << files[2] << "\".\n";
+        return 1;
+    }
+    if(markers.empty() && comms.empty())
+    {
+        cerr << "Warning: No tracelib markers from the traced process; only the CPU tracks are added.\n";
+    }
+
+    //Which tracelib tid each kernel thread's markers match, by votes
+    map<int, map<int, int>> votes;
+    for(const Marker& marker : markers)
+    {
+        auto first = lower_bound(starts.begin(), starts.end(), marker.ts - MARKER_MATCH_US,
+            [](const trace::TraceEvent* e, double ts){ return e->ts < ts; });
+        const trace::TraceEvent* best = nullptr;
+        for(auto it = first; it != starts.end() && (*it)->ts <= marker.ts + MARKER_MATCH_US; ++it)
+        {
+            if((*it)->pid != marker.tgid || (*it)->name != marker.name) continue;
+            if(!best || fabs((*it)->ts - marker.ts) < fabs(best->ts - marker.ts)) best = *it;
+        }
+        if(best) votes[marker.tid][best->tid]++;
+    }
+
+    FILE* output = fopen(files[0], "w");
+    if(!output)
+    {
+        cerr << "Error: Unable to open file \"" << files[0] << "\" for merged output.\n";
+        return 1;
+    }
+    size_t written = 0;
+    fputs("[\n", output);
+    for(const trace::TraceEvent& e : events)
+    {
+        if(trace::event_is_index(e)) continue;
+        if(written++) fputs(",\n", output);
+        fwrite(e.text, 1, e.length, output);
+    }
+    fputs(written ? ",\n" : "", output);
+    fputs("{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0, \"args\": { \"name\": \"kernel scheduler\"} }", output);
+
+    //Replay the scheduler events
+    map<int, CpuState> cpus;
+    map<int, TaskState> tasks;
+    auto tracked = [&](int pid, const string& comm){ return pid != 0 && (threads.count(pid) || comms.count(comm)); };
+    size_t slices = 0;
+    for(const KernelEvent& k : kernel)
+    {
+        if(k.event == "sched_switch")
+        {
+            int prev = atoi(field(k.fields, "prev_pid").c_str());
+            int next = atoi(field(k.fields, "next_pid").c_str());
+            string prevComm = field(k.fields, "prev_comm", " prev_pid=");
+            string nextComm = field(k.fields, "next_comm", " next_pid=");
+            string prevState = field(k.fields, "prev_state");
+
+            CpuState& cpu = cpus[k.cpu];
+            if(cpu.since >= 0 && cpu.pid != 0)
+            {
+                write_slice(output, escaped(cpu.comm).c_str(), CPU_TID_BASE + k.cpu, cpu.since, k.ts, "\"tid\": " + to_string(cpu.pid));
+                slices++;
+            }
+            cpu.pid = next;
+            cpu.comm = nextComm;
+            cpu.since = k.ts;
+
+            if(tracked(prev, prevComm))
+            {
+                TaskState& task = tasks[prev];
+                task.comm = prevComm;
+                if(task.running >= 0)
+                {
+                    write_slice(output, "running", prev, task.running, k.ts,
+                        "\"cpu\": " + to_string(k.cpu) + ", \"prev_state\": \"" + escaped(prevState) + "\", \"next\": \"" + escaped(nextComm) + "-" + to_string(next) + "\"");
+                    slices++;
+                }
+                task.running = -1;
+                bool preempted = !prevState.empty() && prevState[0] == 'R';
+                task.runnable = preempted ? k.ts : -1;
+                task.waker = preempted ? "preempted by " + nextComm + "-" + to_string(next) : "";
+            }
+            if(tracked(next, nextComm))
+            {
+                TaskState& task = tasks[next];
+                task.comm = nextComm;
+                if(task.runnable >= 0)
+                {
+                    write_slice(output, "runnable", next, task.runnable, k.ts, "\"cpu\": " + to_string(k.cpu) + ", \"waker\": \"" + escaped(task.waker) + "\"");
+                    slices++;
+                }
+                task.runnable = -1;
+                task.running = k.ts;
+                task.cpu = k.cpu;
+            }
+        }
+        else //sched_wakeup, sched_wakeup_new
+        {
+            int target = atoi(field(k.fields, "pid").c_str());
+            string comm = field(k.fields, "comm", " pid=");
+            if(!tracked(target, comm)) continue;
+            TaskState& task = tasks[target];
+            task.comm = comm;
+            if(task.running >= 0 || task.runnable >= 0) continue; //Already on a CPU or its runqueue
+            task.runnable = k.ts;
+            task.waker = k.comm + "-" + to_string(k.pid);
+        }
+    }
+
+    for(auto const& cpu : cpus)
+    {
+        fprintf(output, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %i, \"args\": { \"name\": \"CPU %i\"} }", CPU_TID_BASE + cpu.first, cpu.first);
+    }
+    for(auto const& task : tasks)
+    {
+        string name = task.second.comm + "-" + to_string(task.first);
+        auto voted = votes.find(task.first);
+        if(voted != votes.end())
+        {
+            auto most = max_element(voted->second.begin(), voted->second.end(),
+                [](const pair<const int, int>& a, const pair<const int, int>& b){ return a.second < b.second; });
+            name += " (tracelib tid " + to_string(most->first) + ")";
+        }
+        fprintf(output, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %i, \"args\": { \"name\": \"%s\"} }", task.first, escaped(name).c_str());
+    }
+    fputs("\n]", output);
+    fclose(output);
+    cout << "Merged " << kernel.size() << " scheduler events (" << slices << " slices, " << tasks.size() << " threads, "
+         << markers.size() << " markers) into " << files[0] << "\n";
+    return 0;
+}
@@ -4,6 +4,22 @@
 
     Current Functions:
 
+    trace_set_process_name
+    trace_set_writer
+    trace_set_shm_size
+    trace_set_buffer_size
+    trace_set_memory_budget
+    trace_set_sample_rate
+    trace_set_output_format
+    trace_set_compression
+    trace_set_counter_interval
+    trace_set_min_duration
+    trace_set_stack_capture
+    trace_set_sched_stats
+    trace_set_kernel_markers
+    trace_set_hit_interval
+    trace_set_static_strings
+    trace_set_crash_handler
     trace_start
     trace_flush
     trace_end
@@ -13,292 +29,4316 @@
     trace_object_gone
     trace_instant_global
     trace_counter
+    trace_counter_int
+    trace_counter_double
+    trace_reserve
+    trace_record_batch
+    trace_context_capture
+    trace_context_restore
+    trace_signal_prepare
+    trace_signal_event_start
+    trace_signal_event_end
+    trace_signal_instant
+    trace_hit_slot
+    trace_hit
+    trace_point_list
+    trace_enable_points
+
+    These act on defaultTracer; a trace::Tracer object offers the same functions as members
+    for code that wants its own trace file and settings.
+
+    Spans nest by thread. When work moves to another thread, as a task in a pool or a
+    resumed coroutine, trace_context_capture where it is handed off and trace_context_restore
+    (or a TraceContextScope) where it runs link the span started there to the span it came
+    from: both get trace and span ids in their args, joined by a flow arrow.
+
+    The ordinary calls allocate and format, so they must not be used in signal handlers;
+    trace_signal_event_start, trace_signal_event_end and trace_signal_instant (or a
+    TraceSignalScope) record there instead, into a ring trace_signal_prepare sets up for the
+    thread. With trace_set_crash_handler, what the rings hold is also saved if the program
+    crashes.
+
+    The TRACE_SCOPE and TRACE_INSTANT macros record into defaultTracer from call sites that
+    are registered when the program starts, and can each be switched off on their own with
+    trace_enable_points or the TRACELIB_DISABLE environment variable. TRACE_COUNT only counts
+    how often a site runs, without a timestamp; the counts are written as counters at every
+    flush (see Tracer::set_hit_interval).
+
+    Events are recorded as small records and only formatted into JSON when they are
+    flushed. The name and categories strings passed in are copied the first time each is
+    seen, so they can come from c_str() or a stack buffer; a program whose strings all stay
+    valid until trace_end (string literals always do) can skip the copies with
+    trace_set_static_strings. The trace_signal_* calls never copy, so they take literals.
+
+    Uncompressed traces end with an index of the chunks they were written in (see
+    Tracer::write_index), which lets tools read a time window without parsing the whole file.
+*/
+#ifndef TRACELIB_H_INCLUDED
+#define TRACELIB_H_INCLUDED
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <sched.h>
+#include <cstddef>
+#include <new>
+#include <time.h>
+#include <fnmatch.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <pthread.h>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef TRACELIB_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef TRACELIB_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define TRACELIB_HAVE_URING
+#endif
+#endif
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+namespace trace
+{
+using Clock=std::chrono::high_resolution_clock;
+
+/*
+    struct TraceRecord
+
+    One buffered event. Everything except the arguments is kept raw; the arguments are
+    rendered once at record time since their strings may not outlive the call. Numeric
+    counters keep their value in id instead, as its bits, and are rendered at flush. A
+    captured call stack is kept as an index into the tracer's stack table.
+*/
+struct TraceRecord
+{
+    char phase;
+    char value; //COUNTER_NONE, or the type of the counter value held in id
+    const char* name;
+    const char* categories;
+    unsigned int tid;
+    uint32_t stack; //1 + index in the tracer's stack table, or 0 for none
+    int64_t ts; //CLOCK_MONOTONIC nanoseconds
+    uintptr_t id;
+    std::string args; //"\"key\": value, ..." or empty
+};
+
+/*
+    class FormatPool
+
+    A small pool of worker threads that trace_flush uses to format records in parallel.
+    run() hands out tasks numbered 0..tasks-1, helps with them on the calling thread, and
+    returns once all of them are done.
+*/
+class FormatPool
+{
+public:
+    void start(unsigned int threads)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = false;
+        while(workers.size() < threads) workers.push_back(std::thread(&FormatPool::work, this));
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(auto& worker : workers) worker.join();
+        workers.clear();
+    }
+
+    void run(size_t tasks, const std::function<void(size_t)>& fn)
+    {
+        if(workers.empty() || tasks < 2) //Not worth waking anybody
+        {
+            for(size_t i=0; i<tasks; i++) fn(i);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            jobTasks = tasks;
+            nextTask = 0;
+            finishedTasks = 0;
+            generation++;
+        }
+        wake.notify_all();
+        help(fn, tasks);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&]{ return finishedTasks == jobTasks && activeWorkers == 0; });
+        job = nullptr;
+    }
+
+private:
+    void help(const std::function<void(size_t)>& fn, size_t tasks)
+    {
+        for(size_t i = nextTask++; i < tasks; i = nextTask++)
+        {
+            fn(i);
+            finishedTasks++;
+        }
+    }
+
+    void work()
+    {
+        unsigned long seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            wake.wait(lock, [&]{ return stopping || (generation != seen && job); });
+            if(stopping) return;
+            seen = generation;
+            const std::function<void(size_t)>* fn = job;
+            size_t tasks = jobTasks;
+            activeWorkers++;
+            lock.unlock();
+            help(*fn, tasks);
+            lock.lock();
+            activeWorkers--;
+            done.notify_all();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(size_t)>* job = nullptr;
+    size_t jobTasks = 0;
+    std::atomic<size_t> nextTask{0}, finishedTasks{0};
+    unsigned int activeWorkers = 0;
+    unsigned long generation = 0;
+    bool stopping = false;
+};
+
+//Constants and Statics
+const int TRACE_MAX = 10000;
+const size_t FORMAT_CHUNK = 1024; //Records formatted per task in trace_flush
+const unsigned int FORMAT_THREADS = 4; //Upper bound on formatting threads, caller included
+const int TRACE_WRITER_PWRITE = 0; //Synchronous pwritev()
+const int TRACE_WRITER_URING = 1; //Asynchronous io_uring writes, falls back to pwritev()
+const int TRACE_WRITER_SHM = 2; //Shared-memory ring drained by trace_collector
+const int URING_BUFFERS = 4; //Buffers kept in flight by the io_uring writer
+const size_t URING_BUFFER_SIZE = 1 << 20;
+const size_t MERGE_BATCH = 16 * FORMAT_CHUNK; //Merged records formatted and written at a time
+const size_t RETIRED_MAX = 4 * TRACE_MAX; //Retired records held back before they are flushed
+const unsigned int BUSY_STOLEN = 1u << 31; //In ThreadBuffer::busy while a flush takes an idle thread's records
+const size_t BUDGET_MIN_RECORDS = 64; //Smallest thread buffer under a memory budget
+const size_t BUDGET_START_RECORDS = 256; //Thread buffer first granted under a memory budget
+const int64_t BUDGET_FILL_NS = 100000000; //Time a thread buffer should take to fill under a memory budget
+const size_t SIGNAL_RING_RECORDS = 1024; //Default records in a thread's signal-safe ring
+const size_t SHM_SIZE = 64 << 20; //Default bytes in the shared-memory ring
+const int TRACE_FORMAT_JSON = 0; //JSON array, closing bracket kept in place after every flush
+const int TRACE_FORMAT_JSONL = 1; //One JSON object per line, no enclosing array
+const int TRACE_COMPRESS_NONE = 0;
+const int TRACE_COMPRESS_GZIP = 1; //Needs TRACELIB_WITH_ZLIB and -lz
+const int TRACE_COMPRESS_ZSTD = 2; //Needs TRACELIB_WITH_ZSTD and -lzstd
+const size_t STACK_DEPTH = 32; //Most frames kept of a captured call stack
+const int CALIBRATION_SPANS = 1000; //Empty spans timed by trace_start to measure the overhead
+const char COUNTER_NONE = 0;
+const char COUNTER_INT = 1;
+const char COUNTER_DOUBLE = 2;
+static int PID_VALUE = 1; //Set to the real pid by trace_start
+static int TID_VALUE = 1; //For now, always 1
+
+/*
+    int64_t trace_timestamp()
+
+    CLOCK_MONOTONIC in nanoseconds. Every process on the machine shares this clock, so traces
+    from different processes line up without any offset.
+*/
+inline int64_t trace_timestamp()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+/*
+    void trace_sched_sample(fd, cpu, wait)
+
+    The calling thread's CPU time and the total time it has waited in the runqueue, both in
+    nanoseconds. wait comes from /proc/thread-self/schedstat, opened into fd on first use
+    (fd starts at -1, and is -2 once the file turned out not to exist); it is -1 if unknown.
+*/
+inline void trace_sched_sample(int& fd, int64_t& cpu, int64_t& wait)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    cpu = int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+    wait = -1;
+    if(fd == -1)
+    {
+        fd = open("/proc/thread-self/schedstat", O_RDONLY | O_CLOEXEC);
+        if(fd < 0) fd = -2;
+    }
+    if(fd < 0) return;
+    char text[96];
+    ssize_t length = pread(fd, text, sizeof(text) - 1, 0);
+    if(length <= 0) return;
+    text[length] = 0;
+    unsigned long long run, waited;
+    if(sscanf(text, "%llu %llu", &run, &waited) == 2) wait = int64_t(waited);
+}
+
+/*
+    bool trace_pwrite_all(fd, iov, count, offset)
+
+    pwritev() the whole iovec array at offset, coping with IOV_MAX and short writes. Output is
+    true if everything was written.
+*/
+inline bool trace_pwrite_all(int fd, struct iovec* iov, size_t count, uint64_t offset)
+{
+    while(count > 0)
+    {
+        ssize_t written = pwritev(fd, iov, int(count < IOV_MAX ? count : IOV_MAX), off_t(offset));
+        if(written < 0)
+        {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        offset += written;
+        while(count > 0 && size_t(written) >= iov->iov_len) //Skip fully written entries
+        {
+            written -= iov->iov_len;
+            iov++; count--;
+        }
+        if(count > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/*
+    struct ShmHeader
+
+    Start of the shared-memory region used by TRACE_WRITER_SHM, followed by the ring itself.
+    The traced process is the only writer and trace_collector the only reader, so the ring
+    needs no locks: writePos and readPos count bytes ever written and read, each is stored only
+    by its owner, with release ordering so the data it covers is visible before it is.
+*/
+struct ShmHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    std::atomic<uint32_t> state; //SHM_WRITING until the writer closes, then SHM_DONE
+    uint64_t capacity; //Bytes in the ring, a power of two
+    char path[PATH_MAX]; //Where the collector should write the trace
+    std::atomic<int32_t> collectorPid; //Nonzero while a collector is attached
+    std::atomic<uint64_t> dropped; //Bytes thrown away because the ring was full
+    std::atomic<uint64_t> droppedAppends; //Appends those bytes made up
+    alignas(64) std::atomic<uint64_t> writePos;
+    alignas(64) std::atomic<uint64_t> readPos;
+    alignas(64) char ring[1];
+};
+
+const uint32_t SHM_MAGIC = 0x54524345; //"TRCE"
+const uint32_t SHM_VERSION = 2;
+const uint32_t SHM_WRITING = 0;
+const uint32_t SHM_DONE = 1;
+
+/*
+    std::string trace_shm_name(pid)
+
+    Name of the shared-memory object a traced process writes to.
+*/
+inline std::string trace_shm_name(int pid)
+{
+    return "/tracelib." + std::to_string(pid);
+}
+
+/*
+    class TraceWriter
+
+    Owns the trace output file and appends data to it at a tracked offset. Three backends exist:
+
+    TRACE_WRITER_PWRITE writes synchronously with pwritev().
+    TRACE_WRITER_URING copies data into URING_BUFFERS aligned buffers registered with an io_uring,
+    together with the file itself, and keeps up to all of them in flight as fixed writes. If the
+    ring can't be set up (old kernel, seccomp, ...) the writer falls back to pwritev().
+    TRACE_WRITER_SHM does no file I/O at all: it copies data into a ring in the POSIX shared memory
+    object trace_shm_name(getpid()), and trace_collector writes it to the file. While a collector
+    is attached a full ring is waited on; without one a whole append is dropped and counted, so
+    the stream never holds part of a record. If the ring can't be set up, or the file's full
+    path doesn't fit in its header, the writer falls back to pwritev().
+
+    Output can also be compressed on the way out (TRACE_COMPRESS_GZIP through zlib,
+    TRACE_COMPRESS_ZSTD through libzstd, each only when tracelib is built with it). Every
+    append() ends with a sync flush of the compressor, so the file decompresses up to the last
+    flush even if the process dies; the stream is only finished by close().
+
+    sync() waits for everything in flight; close() syncs first.
+*/
+class TraceWriter
+{
+public:
+    bool open(const char* filename, int requested, size_t ringSize=SHM_SIZE, int compress=TRACE_COMPRESS_NONE)
+    {
+        if(!compress_setup(compress)) return false;
+        bool opened = requested == TRACE_WRITER_SHM ? shm_setup(filename, ringSize) : open_file(filename, requested);
+        if(!opened && requested == TRACE_WRITER_SHM)
+        {
+            std::cerr << "Warning: The shared-memory ring is unavailable; trace output falls back to pwrite.\n";
+            opened = open_file(filename, TRACE_WRITER_PWRITE);
+        }
+        if(!opened)
+        {
+            compress_finish(); //Frees the compressor
+            compression = TRACE_COMPRESS_NONE;
+        }
+        return opened;
+    }
+
+    bool is_open() const { return fd >= 0; }
+    int backend_in_use() const { return backend; }
+    uint64_t offset() const { return position; }
+
+    bool append(struct iovec* iov, size_t count)
+    {
+        if(compression != TRACE_COMPRESS_NONE)
+        {
+            compressedLength = 0;
+            for(size_t i=0; i<count; i++) compress((const char*)iov[i].iov_base, iov[i].iov_len, false);
+            compress(nullptr, 0, true);
+            return store(compressed.data(), compressedLength);
+        }
+        return store(iov, count);
+    }
+
+    bool append(const char* data, size_t length)
+    {
+        struct iovec iov;
+        iov.iov_base = (void*)data;
+        iov.iov_len = length;
+        return append(&iov, 1);
+    }
+
+    /*
+        bool write_trailer(data, length)
+
+        Writes data after everything appended so far without advancing the offset, so the next
+        append overwrites it. Earlier appends are synced first, so the file is complete up to
+        and including the trailer. Streams (TRACE_WRITER_SHM) and compressed output can't be
+        rewritten and skip it.
+    */
+    bool write_trailer(const char* data, size_t length)
+    {
+        if(backend == TRACE_WRITER_SHM || compression != TRACE_COMPRESS_NONE) return true;
+        if(!sync()) return false;
+        struct iovec iov;
+        iov.iov_base = (void*)data;
+        iov.iov_len = length;
+        return trace_pwrite_all(fd, &iov, 1, position);
+    }
+
+    bool sync()
+    {
+#ifdef TRACELIB_HAVE_URING
+        if(backend == TRACE_WRITER_URING)
+        {
+            if(fill[current] > 0 && !inFlight[current]) uring_submit(current);
+            while(pending > 0) uring_reap(true);
+        }
+#endif
+        return !failed;
+    }
+
+    bool close()
+    {
+        if(fd < 0) return true;
+        bool ok = true;
+        if(compression != TRACE_COMPRESS_NONE)
+        {
+            compressedLength = 0;
+            compress_finish();
+            ok = store(compressed.data(), compressedLength);
+            compression = TRACE_COMPRESS_NONE;
+        }
+        if(backend == TRACE_WRITER_SHM)
+        {
+            shm_teardown();
+            return ok;
+        }
+        ok = sync() && ok;
+#ifdef TRACELIB_HAVE_URING
+        if(backend == TRACE_WRITER_URING) uring_teardown();
+#endif
+        ::close(fd);
+        fd = -1;
+        return ok;
+    }
+
+private:
+    int fd = -1;
+    int backend = TRACE_WRITER_PWRITE;
+    uint64_t position = 0; //Offset of the next appended byte
+    bool failed = false;
+
+    bool open_file(const char* filename, int requested)
+    {
+        fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) return false;
+        position = 0;
+        failed = false;
+        backend = TRACE_WRITER_PWRITE;
+        if(requested == TRACE_WRITER_URING)
+        {
+            if(uring_setup()) backend = TRACE_WRITER_URING;
+            else std::cerr << "Warning: io_uring is unavailable; trace output falls back to pwrite.\n";
+        }
+        return true;
+    }
+
+    bool store(const char* data, size_t length)
+    {
+        struct iovec iov;
+        iov.iov_base = (void*)data;
+        iov.iov_len = length;
+        return store(&iov, 1);
+    }
+
+    bool store(struct iovec* iov, size_t count)
+    {
+        if(backend == TRACE_WRITER_SHM)
+        {
+            shm_store(iov, count);
+            return true;
+        }
+#ifdef TRACELIB_HAVE_URING
+        if(backend == TRACE_WRITER_URING)
+        {
+            for(size_t i=0; i<count; i++) uring_copy((const char*)iov[i].iov_base, iov[i].iov_len);
+            return !failed;
+        }
+#endif
+        size_t total = 0;
+        for(size_t i=0; i<count; i++) total += iov[i].iov_len;
+        if(!trace_pwrite_all(fd, iov, count, position)) return false;
+        position += total;
+        return true;
+    }
+
+    int compression = TRACE_COMPRESS_NONE;
+    std::string compressed; //Output of the compressor for the current append...
+    size_t compressedLength = 0; //...of which this much is used
+#ifdef TRACELIB_WITH_ZLIB
+    z_stream zlib;
+#endif
+#ifdef TRACELIB_WITH_ZSTD
+    ZSTD_CCtx* zstd = nullptr;
+#endif
+
+    bool compress_setup(int requested)
+    {
+        compression = TRACE_COMPRESS_NONE;
+        if(requested == TRACE_COMPRESS_GZIP)
+        {
+#ifdef TRACELIB_WITH_ZLIB
+            memset(&zlib, 0, sizeof(zlib));
+            if(deflateInit2(&zlib, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false; //+16 for a gzip header; fastest level, as trace text compresses well anyway
+            compression = requested;
+#else
+            std::cerr << "Error: gzip trace output needs tracelib built with -DTRACELIB_WITH_ZLIB -lz.\n";
+            return false;
+#endif
+        }
+        else if(requested == TRACE_COMPRESS_ZSTD)
+        {
+#ifdef TRACELIB_WITH_ZSTD
+            zstd = ZSTD_createCCtx();
+            if(!zstd) return false;
+            ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, 3);
+            compression = requested;
+#else
+            std::cerr << "Error: zstd trace output needs tracelib built with -DTRACELIB_WITH_ZSTD -lzstd.\n";
+            return false;
+#endif
+        }
+        return true;
+    }
+
+    //Makes sure compressed has free space after compressedLength and returns how much
+    size_t compress_room(size_t wanted)
+    {
+        wanted = std::max<size_t>(wanted / 4, 1 << 16);
+        if(compressed.size() - compressedLength < wanted) compressed.resize(compressedLength + 2 * wanted);
+        return compressed.size() - compressedLength;
+    }
+
+    //Compresses data onto the end of compressed; flush ends the block so it can be decoded
+    void compress(const char* data, size_t length, bool flush)
+    {
+#ifdef TRACELIB_WITH_ZLIB
+        if(compression == TRACE_COMPRESS_GZIP)
+        {
+            zlib.next_in = (Bytef*)data;
+            zlib.avail_in = uInt(length);
+            do
+            {
+                size_t room = compress_room(length);
+                zlib.next_out = (Bytef*)&compressed[compressedLength];
+                zlib.avail_out = uInt(room);
+                deflate(&zlib, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+                compressedLength += room - zlib.avail_out;
+            } while(zlib.avail_in > 0 || zlib.avail_out == 0);
+        }
+#endif
+#ifdef TRACELIB_WITH_ZSTD
+        if(compression == TRACE_COMPRESS_ZSTD)
+        {
+            ZSTD_inBuffer in = { data, length, 0 };
+            size_t remaining;
+            do
+            {
+                size_t room = compress_room(std::max<size_t>(ZSTD_CStreamOutSize(), length));
+                ZSTD_outBuffer out = { &compressed[compressedLength], room, 0 };
+                remaining = ZSTD_compressStream2(zstd, &out, &in, flush ? ZSTD_e_flush : ZSTD_e_continue);
+                compressedLength += out.pos;
+                if(ZSTD_isError(remaining)) { failed = true; return; }
+            } while(in.pos < in.size || (flush && remaining > 0));
+        }
+#endif
+        (void)data; (void)length; (void)flush;
+    }
+
+    //Ends the compressed stream onto compressed and frees the compressor
+    void compress_finish()
+    {
+#ifdef TRACELIB_WITH_ZLIB
+        if(compression == TRACE_COMPRESS_GZIP)
+        {
+            zlib.next_in = nullptr;
+            zlib.avail_in = 0;
+            int status;
+            do
+            {
+                size_t room = compress_room(4096);
+                zlib.next_out = (Bytef*)&compressed[compressedLength];
+                zlib.avail_out = uInt(room);
+                status = deflate(&zlib, Z_FINISH);
+                compressedLength += room - zlib.avail_out;
+            } while(status == Z_OK);
+            deflateEnd(&zlib);
+        }
+#endif
+#ifdef TRACELIB_WITH_ZSTD
+        if(compression == TRACE_COMPRESS_ZSTD)
+        {
+            ZSTD_inBuffer in = { nullptr, 0, 0 };
+            size_t remaining;
+            do
+            {
+                size_t room = compress_room(ZSTD_CStreamOutSize());
+                ZSTD_outBuffer out = { &compressed[compressedLength], room, 0 };
+                remaining = ZSTD_compressStream2(zstd, &out, &in, ZSTD_e_end);
+                compressedLength += out.pos;
+            } while(remaining > 0 && !ZSTD_isError(remaining));
+            ZSTD_freeCCtx(zstd);
+            zstd = nullptr;
+        }
+#endif
+    }
+
+    ShmHeader* shm = nullptr;
+    size_t shmBytes = 0;
+
+    bool shm_setup(const char* filename, size_t ringSize)
+    {
+        uint64_t capacity = 4096;
+        while(capacity < ringSize) capacity <<= 1;
+        shmBytes = offsetof(ShmHeader, ring) + capacity;
+        std::string name = trace_shm_name(getpid());
+        shm_unlink(name.c_str()); //Left over from an earlier process with the same pid
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if(fd < 0) return false;
+        void* memory = MAP_FAILED;
+        if(ftruncate(fd, off_t(shmBytes)) == 0)
+        {
+            memory = mmap(nullptr, shmBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if(memory == MAP_FAILED)
+        {
+            ::close(fd);
+            shm_unlink(name.c_str());
+            fd = -1;
+            return false;
+        }
+        shm = new(memory) ShmHeader(); //Fresh pages are zero, but construct the atomics anyway
+        shm->version = SHM_VERSION;
+        shm->pid = getpid();
+        shm->capacity = capacity;
+        char resolved[PATH_MAX];
+        int length;
+        if(filename[0] != '/' && getcwd(resolved, sizeof(resolved))) //The collector runs elsewhere
+        {
+            length = snprintf(shm->path, sizeof(shm->path), "%s/%s", resolved, filename);
+        }
+        else length = snprintf(shm->path, sizeof(shm->path), "%s", filename);
+        if(length < 0 || size_t(length) >= sizeof(shm->path)) //Truncated, it would name another file
+        {
+            munmap(memory, shmBytes);
+            ::close(fd);
+            shm_unlink(name.c_str());
+            fd = -1;
+            shm = nullptr;
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        shm->magic = SHM_MAGIC; //Published last so a collector never sees half a header
+        backend = TRACE_WRITER_SHM;
+        position = 0;
+        failed = false;
+        return true;
+    }
+
+    /*
+        void shm_store(iov, count)
+
+        Copies one append into the ring. An append that fits in the ring is published at once,
+        after waiting for room while a collector is attached, or dropped whole without one. A
+        larger one needs a collector, and goes in pieces of half the ring so it can free room
+        meanwhile; only if the collector goes away part way is the rest of it lost.
+    */
+    void shm_store(struct iovec* iov, size_t count)
+    {
+        size_t total = 0;
+        for(size_t i=0; i<count; i++) total += iov[i].iov_len;
+        if(total == 0) return;
+        uint64_t write = shm->writePos.load(std::memory_order_relaxed);
+        if(total <= shm->capacity)
+        {
+            if(!shm_room(write, total))
+            {
+                shm_drop(total);
+                return;
+            }
+            for(size_t i=0; i<count; i++) shm_copy(write, (const char*)iov[i].iov_base, iov[i].iov_len);
+            shm->writePos.store(write, std::memory_order_release);
+            position += total;
+            return;
+        }
+        if(!shm_collector())
+        {
+            shm_drop(total);
+            return;
+        }
+        for(size_t i=0; i<count; i++)
+        {
+            const char* data = (const char*)iov[i].iov_base;
+            size_t length = iov[i].iov_len;
+            while(length > 0)
+            {
+                size_t piece = std::min<size_t>(length, shm->capacity / 2);
+                if(!shm_room(write, piece))
+                {
+                    shm_drop(total); //Counted whole; the collector it was streaming to is gone
+                    return;
+                }
+                shm_copy(write, data, piece);
+                shm->writePos.store(write, std::memory_order_release);
+                position += piece;
+                data += piece; length -= piece;
+            }
+        }
+    }
+
+    bool shm_collector()
+    {
+        int collector = shm->collectorPid.load(std::memory_order_relaxed);
+        return collector != 0 && kill(collector, 0) == 0;
+    }
+
+    bool shm_room(uint64_t write, size_t length)
+    {
+        while(write + length - shm->readPos.load(std::memory_order_acquire) > shm->capacity)
+        {
+            if(!shm_collector()) return false;
+            sched_yield(); //The collector is draining, wait for room
+        }
+        return true;
+    }
+
+    void shm_copy(uint64_t& write, const char* data, size_t length)
+    {
+        uint64_t mask = shm->capacity - 1;
+        size_t first = std::min<size_t>(length, shm->capacity - (write & mask));
+        memcpy(shm->ring + (write & mask), data, first);
+        memcpy(shm->ring, data + first, length - first);
+        write += length;
+    }
+
+    void shm_drop(size_t length)
+    {
+        shm->dropped.fetch_add(length, std::memory_order_relaxed);
+        shm->droppedAppends.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void shm_teardown()
+    {
+        shm->state.store(SHM_DONE, std::memory_order_release);
+        munmap(shm, shmBytes);
+        shm = nullptr;
+        ::close(fd); //The collector unlinks the object once it has drained it
+        fd = -1;
+    }
+
+#ifdef TRACELIB_HAVE_URING
+    int ringFd = -1;
+    void* sqRing = MAP_FAILED; size_t sqRingSize = 0;
+    void* cqRing = MAP_FAILED; size_t cqRingSize = 0;
+    struct io_uring_sqe* sqes = (struct io_uring_sqe*)MAP_FAILED; size_t sqesSize = 0;
+    unsigned *sqTail = nullptr, *sqMask = nullptr, *sqArray = nullptr;
+    unsigned *cqHead = nullptr, *cqTail = nullptr, *cqMask = nullptr;
+    struct io_uring_cqe* cqes = nullptr;
+    char* buffers[URING_BUFFERS] = {};
+    size_t fill[URING_BUFFERS] = {};
+    uint64_t bufferOffset[URING_BUFFERS] = {};
+    bool inFlight[URING_BUFFERS] = {};
+    int current = 0;
+    unsigned pending = 0;
+
+    bool uring_setup()
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = int(syscall(__NR_io_uring_setup, URING_BUFFERS * 2, &params));
+        if(ringFd < 0) return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(single) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if(sqRing == MAP_FAILED) { uring_teardown(); return false; }
+        cqRing = single ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if(cqRing == MAP_FAILED) { uring_teardown(); return false; }
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED) { uring_teardown(); return false; }
+
+        sqTail  = (unsigned*)((char*)sqRing + params.sq_off.tail);
+        sqMask  = (unsigned*)((char*)sqRing + params.sq_off.ring_mask);
+        sqArray = (unsigned*)((char*)sqRing + params.sq_off.array);
+        cqHead  = (unsigned*)((char*)cqRing + params.cq_off.head);
+        cqTail  = (unsigned*)((char*)cqRing + params.cq_off.tail);
+        cqMask  = (unsigned*)((char*)cqRing + params.cq_off.ring_mask);
+        cqes    = (struct io_uring_cqe*)((char*)cqRing + params.cq_off.cqes);
+
+        struct iovec iov[URING_BUFFERS];
+        for(int i=0; i<URING_BUFFERS; i++)
+        {
+            void* memory = nullptr;
+            if(posix_memalign(&memory, 4096, URING_BUFFER_SIZE) != 0) { uring_teardown(); return false; }
+            buffers[i] = (char*)memory;
+            iov[i].iov_base = memory;
+            iov[i].iov_len = URING_BUFFER_SIZE;
+            fill[i] = 0;
+            inFlight[i] = false;
+        }
+        if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0 ||
+           syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES, &fd, 1) < 0)
+        {
+            uring_teardown();
+            return false;
+        }
+        current = 0;
+        pending = 0;
+        return true;
+    }
+
+    void uring_teardown()
+    {
+        if(sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if(cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if(sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        sqes = (struct io_uring_sqe*)MAP_FAILED;
+        sqRing = cqRing = MAP_FAILED;
+        if(ringFd >= 0) ::close(ringFd); //Also drops the registered buffers and file
+        ringFd = -1;
+        for(int i=0; i<URING_BUFFERS; i++)
+        {
+            free(buffers[i]);
+            buffers[i] = nullptr;
+        }
+    }
+
+    void uring_copy(const char* data, size_t length)
+    {
+        while(length > 0)
+        {
+            if(fill[current] == 0) bufferOffset[current] = position;
+            size_t n = std::min(length, URING_BUFFER_SIZE - fill[current]);
+            memcpy(buffers[current] + fill[current], data, n);
+            fill[current] += n;
+            position += n;
+            data += n; length -= n;
+            if(fill[current] == URING_BUFFER_SIZE)
+            {
+                uring_submit(current);
+                current = (current + 1) % URING_BUFFERS;
+                while(inFlight[current]) uring_reap(true); //Wait for the oldest write to finish
+            }
+        }
+    }
+
+    void uring_submit(int i)
+    {
+        unsigned tail = *sqTail;
+        unsigned index = tail & *sqMask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = 0; //Index into the registered files
+        sqe->addr = (uint64_t)(uintptr_t)buffers[i];
+        sqe->len = unsigned(fill[i]);
+        sqe->off = bufferOffset[i];
+        sqe->buf_index = (uint16_t)i;
+        sqe->user_data = (uint64_t)i;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        inFlight[i] = true;
+        pending++;
+        while(syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0) < 0 && errno == EINTR) {}
+    }
+
+    void uring_reap(bool wait)
+    {
+        unsigned head = *cqHead;
+        if(wait && head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        {
+            while(syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno == EINTR) {}
+        }
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++)
+        {
+            struct io_uring_cqe* cqe = &cqes[head & *cqMask];
+            int i = int(cqe->user_data);
+            if(cqe->res < 0)
+            {
+                std::cerr << "Error: io_uring trace write failed: " << strerror(-cqe->res) << "\n";
+                failed = true;
+            }
+            else if(size_t(cqe->res) < fill[i]) //Short write, finish it synchronously
+            {
+                struct iovec rest;
+                rest.iov_base = buffers[i] + cqe->res;
+                rest.iov_len = fill[i] - cqe->res;
+                if(!trace_pwrite_all(fd, &rest, 1, bufferOffset[i] + cqe->res)) failed = true;
+            }
+            fill[i] = 0;
+            inFlight[i] = false;
+            pending--;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+#endif
+};
+
+/*
+    struct CounterState
+
+    One numeric counter a thread has set, with the value recorded last and any held back.
+*/
+struct CounterState
+{
+    const char* name;
+    char value; //COUNTER_INT or COUNTER_DOUBLE
+    uint64_t bits; //Last value recorded
+    int64_t ts; //When it was recorded
+    bool pending; //A newer value is waiting for the interval to pass
+    char pendingValue;
+    uint64_t pendingBits;
+    int64_t pendingTs;
+    unsigned int tid;
+};
+
+/*
+    struct OpenSpan
+
+    A span a thread has open while minimum durations or scheduler stats are on.
+*/
+struct OpenSpan
+{
+    size_t index = 0; //Of its start record in records
+    unsigned int generation = 0; //records generation the index belongs to
+    int filter = -1; //Index in the tracer's minimum durations, or -1
+    int64_t ts = 0;
+    int64_t cpu = 0; //Thread CPU time at the start, with scheduler stats on
+    int64_t wait = -1; //Runqueue wait at the start, or -1
+};
+
+/*
+    struct SpanContext
+
+    Where a piece of work came from, to carry to the thread that runs it: the trace (the
+    tree of spans it belongs to, named by its root span), the span it was handed off from,
+    and the flow linking the two in the trace. All 0 for no context.
+*/
+struct SpanContext
+{
+    uint64_t trace = 0;
+    uint64_t span = 0;
+    uint64_t flow = 0;
+};
+
+/*
+    struct SpanIds
+
+    The ids of one open span with a context: its own and its trace's.
+*/
+struct SpanIds
+{
+    uint64_t span; //0 until the span is captured or adopts a context
+    uint64_t trace; //0 until known
+};
+
+/*
+    struct ElidedSpans
+
+    Spans of one minimum duration filter that were dropped, and the time they took.
+*/
+struct ElidedSpans
+{
+    uint64_t count = 0;
+    int64_t total = 0; //Nanoseconds
+};
+
+/*
+    struct SignalRecord
+
+    One record of a SignalRing, published once sequence is stored.
+*/
+struct SignalRecord
+{
+    char phase;
+    const char* name;
+    const char* categories;
+    unsigned int tid;
+    unsigned int epoch;
+    int64_t ts;
+    std::atomic<uint64_t> sequence; //1 + its position once written
+};
+
+/*
+    struct SignalRing
+
+    A fixed ring of records that a thread fills from signal handlers (see
+    Tracer::signal_prepare), allocated beforehand so recording into it needs no allocation or
+    lock. Writers, which may interrupt each other on the same thread, claim positions with a
+    compare-and-swap on claimed and publish a record by storing its sequence; the flushing
+    thread drains published records in order, advancing read, and a record that would overwrite
+    one not yet drained is dropped instead. Room is kept for the end of every span recorded,
+    and a span dropped is dropped whole, so the spans that are kept still pair up. The
+    outermost writer stores the time it started in since, so a flush knows how old a record
+    still being written can be. The rings of a tracer are linked for the crash handler to walk
+    without a lock; a ring whose thread exited is reused.
+*/
+struct SignalRing
+{
+    SignalRecord* records;
+    size_t capacity;
+    std::atomic<uint64_t> claimed{0}; //Positions taken by writers
+    std::atomic<uint64_t> read{0}; //Positions drained
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> open{0}; //Spans recorded and not ended, whose ends have room kept
+    std::atomic<uint64_t> skipped{0}; //Spans dropped and not ended, whose ends are dropped too
+    std::atomic<unsigned int> writing{0}; //Handlers inside a write, nested ones included
+    std::atomic<int64_t> since{INT64_MIN}; //When the outermost writer started; INT64_MIN while it sets it
+    std::atomic<bool> owned{true}; //A live thread writes to it
+    SignalRing* next = nullptr;
+
+    explicit SignalRing(size_t capacity) : records(new SignalRecord[capacity]()), capacity(capacity) {}
+    ~SignalRing() { delete[] records; }
+};
+
+/*
+    struct SignalSlot
+
+    The calling thread's ring in one tracer, keyed by the tracer's uid, so a handler finds it
+    without the thread_buffer() lookup, which may allocate. signal_prepare fills a slot outside
+    any handler, storing the ring before the uid; a handler that finds the uid finds the ring.
+    Uids are never reused, so the slot of a destroyed tracer never matches again.
+*/
+struct SignalSlot
+{
+    std::atomic<uint64_t> uid;
+    SignalRing* ring;
+};
+
+const int SIGNAL_TRACERS = 4; //Tracers a thread can record into from signal handlers
+static thread_local SignalSlot signalSlots[SIGNAL_TRACERS];
+
+/*
+    struct ThreadBuffer
+
+    The records of one thread in one Tracer, appended without any locking. A thread's records
+    are in time order, so every buffer (and every full buffer retired from it) is a sorted
+    stream that flush merges with the others. A thread's remaining records are retired when it
+    exits.
+
+    busy is nonzero while the thread is inside a recording call (see Recording); other threads
+    only set BUSY_STOLEN in it, from 0, while a flush takes the records of an idle thread.
+    oldest bounds the timestamps of the records in the buffer and of those the thread records
+    next: INT64_MAX while it is closed, with nothing buffered, and INT64_MIN while the thread
+    is opening it (see Tracer::collect_streams). epoch is the session the buffer's state
+    belongs to. depth and skipDepth follow span nesting for sampling. counters holds the
+    numeric counters the thread has set. spans holds the open spans while minimum durations or
+    scheduler stats are on, and elided counts the spans dropped by minimum durations, per
+    filter. The stack fields serve call stack capture. schedFd is the thread's schedstat file
+    (see trace_sched_sample). spanIds holds the ids of the open spans by depth, only as deep as
+    a context was captured or adopted, and adopted the context restored for the next span
+    start. limit is the number of records the buffer holds before it is retired, and
+    filledSince when it last started filling; both change under the tracer's bufferMutex only
+    (see Tracer::set_memory_budget). signalRing is the thread's ring for signal handlers in
+    this tracer, if it has one.
+*/
+struct ThreadBuffer
+{
+    std::vector<TraceRecord> records;
+    std::atomic<unsigned int> busy{0};
+    std::atomic<int64_t> oldest{INT64_MAX};
+    unsigned int epoch = 0;
+    unsigned int depth = 0; //Open spans that were recorded
+    unsigned int skipDepth = 0; //Open spans inside a span that sampling left out
+    unsigned int topSpans = 0; //Top-level spans seen, for sampling
+    std::vector<CounterState> counters;
+    size_t lastCounter = 0; //Index of the counter set last
+    std::vector<OpenSpan> spans;
+    std::vector<ElidedSpans> elided;
+    unsigned int generation = 0; //Bumped whenever records is handed off for writing
+    const char* lastFilterName = nullptr; //Cache of the last minimum duration lookup
+    int lastFilter = -1;
+    const char* lastStackName = nullptr; //Cache of the last stack capture lookup
+    std::unordered_map<const char*, const char*> interned; //Caller's strings to their copies (see Tracer::intern)
+    bool lastStackCapture = false;
+    uintptr_t stackTop = 0; //Highest address of the thread's stack, 0 until looked up
+    uintptr_t frames[STACK_DEPTH];
+    std::unordered_map<uint64_t, uint32_t> stackIds; //Stacks this thread has seen, by hash
+    int schedFd = -1;
+    std::vector<SpanIds> spanIds;
+    SpanContext adopted;
+    std::atomic<size_t> limit{TRACE_MAX};
+    int64_t filledSince = 0;
+    SignalRing* signalRing = nullptr;
+
+    ~ThreadBuffer()
+    {
+        if(schedFd >= 0) close(schedFd);
+    }
+};
+
+/*
+    struct ChunkEntry
+
+    Where one written batch of records is in the trace file, the time it covers, and the
+    offset of the first record of each thread in it.
+*/
+struct ChunkEntry
+{
+    uint64_t offset;
+    uint64_t length;
+    int64_t first; //Timestamps, nanoseconds
+    int64_t last;
+    size_t records;
+    size_t metadata; //Of the records, those without a timestamp
+    std::vector<std::pair<unsigned int, uint64_t>> threads; //tid, file offset
+};
+
+/*
+    struct BatchEvent
+
+    One event for trace_record_batch, timestamped by the caller with trace_timestamp():
+    a span start ('B', with name and categories), a span end ('E') or an instant ('i', with
+    name).
+*/
+struct BatchEvent
+{
+    char phase;
+    const char* name;
+    const char* categories;
+    unsigned int tid;
+    int64_t ts; //CLOCK_MONOTONIC nanoseconds
+};
+
+class Tracer;
+
+/*
+    class TraceReservation
+
+    Slots claimed in the calling thread's buffer by trace_reserve, filled by its event_start,
+    event_end and instant without the capacity check of each recording call. A timestamp of
+    0 reads the clock; pass one from trace_timestamp() to share one reading between events.
+    Each call returns false once the slots are used up, if tracing was not active when they
+    were reserved, or once the session they were reserved in has ended.
+
+    Must be used on the thread that reserved it, and kept short: trace_end on another thread
+    waits for it to be destroyed, and flushes hold back the other threads' records from after
+    it was made. trace_end on the reserving thread itself ends the session without waiting. A reading taken before trace_reserve can be written after later
+    events of other threads if a flush runs meanwhile.
+*/
+class TraceReservation
+{
+public:
+    TraceReservation() : buffer(nullptr), tracer(nullptr), epoch(0), tid(0), left(0) {}
+    TraceReservation(TraceReservation&& other) : buffer(other.buffer), tracer(other.tracer), epoch(other.epoch), tid(other.tid), left(other.left) { other.buffer = nullptr; }
+    TraceReservation(const TraceReservation&) = delete;
+    TraceReservation& operator=(const TraceReservation&) = delete;
+    ~TraceReservation()
+    {
+        if(buffer) buffer->busy.store(buffer->busy.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+    }
+
+    size_t remaining() const { return left; }
+    bool event_start(const char* name, const char* categories, int64_t ts=0) { return fill('B', name, categories, ts); }
+    bool event_end(int64_t ts=0) { return fill('E', nullptr, nullptr, ts); }
+    bool instant(const char* name, int64_t ts=0) { return fill('i', name, nullptr, ts); }
+
+private:
+    friend class Tracer;
+
+    TraceReservation(ThreadBuffer& buffer, Tracer& tracer, unsigned int tid, size_t count)
+        : buffer(&buffer), tracer(&tracer), epoch(buffer.epoch), tid(tid), left(count)
+    {
+        buffer.busy.store(buffer.busy.load(std::memory_order_relaxed) + 1); //Held until destroyed, like a Recording
+    }
+
+    bool fill(char phase, const char* name, const char* categories, int64_t ts);
+
+    ThreadBuffer* buffer;
+    Tracer* tracer; //The one reserved in
+    unsigned int epoch; //Session the slots were reserved in
+    unsigned int tid;
+    size_t left;
+};
+
+/*
+    struct ThreadSlots
+
+    Per-thread table of the buffers the thread owns in each Tracer, keyed by the tracer's uid.
+    The last one used is cached, so a thread recording into one tracer finds its buffer with a
+    single compare. Uids are never reused, so entries for destroyed tracers never match again.
+    On thread exit the buffers are handed back to the tracers that still exist.
+*/
+struct ThreadSlots
+{
+    std::vector<std::pair<uint64_t, ThreadBuffer*>> slots;
+    uint64_t lastUid = 0;
+    ThreadBuffer* last = nullptr;
+    ~ThreadSlots();
+};
+
+static thread_local ThreadSlots threadSlots;
+static std::mutex tracerRegistryMutex; //Guards tracerRegistry
+static std::vector<Tracer*> tracerRegistry; //Every live Tracer
+static std::atomic<uint64_t> nextTracerUid(1);
+static std::atomic<Tracer*> crashTracer{nullptr}; //Tracer whose crash handler is installed
+static const int CRASH_SIGNALS[5] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+static std::mutex calibrationMutex; //Guards the two below
+static int64_t calibratedSpan = -1; //Tracing overhead measured by the first calibrate(), -1 before it
+static int64_t calibratedEvent = 0;
+
+/*
+    struct HitCounts
+
+    One thread's hit counts (see TRACE_COUNT), one slot per counted name, in blocks of
+    HIT_BLOCK allocated as the thread first counts a name in them. Each slot has a cache line
+    to itself, and only the owning thread stores to it, so counting takes no lock, atomic
+    read-modify-write or clock read; trace_hit_totals reads the slots from other threads.
+    Every thread's counts are linked into hitThreads, and added to hitRetired as it exits.
+*/
+const int HIT_BLOCK = 64; //Slots per block of a thread's hit counts
+const int HIT_SLOTS = 64 * HIT_BLOCK; //Distinct counted names
+
+struct alignas(64) HitSlot
+{
+    std::atomic<uint64_t> count;
+};
+
+struct HitCounts
+{
+    std::atomic<HitSlot*> blocks[HIT_SLOTS / HIT_BLOCK];
+    HitCounts* next;
+
+    HitCounts();
+    ~HitCounts();
+    HitSlot* add_block(int block);
+};
+
+static std::mutex hitMutex; //Guards hitNames, hitSlotCount, hitThreads and hitRetired
+static const char* hitNames[HIT_SLOTS]; //Name of each slot
+static int hitSlotCount = 0;
+static HitCounts* hitThreads = nullptr;
+static uint64_t hitRetired[HIT_SLOTS]; //Counts of threads that exited
+static thread_local HitCounts hitCounts;
+
+inline HitCounts::HitCounts()
+{
+    for(auto& block : blocks) block.store(nullptr, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(hitMutex);
+    next = hitThreads;
+    hitThreads = this;
+}
+
+inline HitCounts::~HitCounts()
+{
+    std::lock_guard<std::mutex> lock(hitMutex);
+    HitCounts** link = &hitThreads;
+    while(*link != this) link = &(*link)->next;
+    *link = next;
+    for(int b=0; b<HIT_SLOTS / HIT_BLOCK; b++)
+    {
+        HitSlot* block = blocks[b].load(std::memory_order_relaxed);
+        if(!block) continue;
+        for(int i=0; i<HIT_BLOCK; i++) hitRetired[b * HIT_BLOCK + i] += block[i].count.load(std::memory_order_relaxed);
+        free(block);
+    }
+}
+
+inline HitSlot* HitCounts::add_block(int block)
+{
+    void* memory = nullptr;
+    if(posix_memalign(&memory, sizeof(HitSlot), HIT_BLOCK * sizeof(HitSlot)) != 0) return nullptr;
+    HitSlot* slots = static_cast<HitSlot*>(memory);
+    for(int i=0; i<HIT_BLOCK; i++) new (&slots[i].count) std::atomic<uint64_t>(0);
+    blocks[block].store(slots, std::memory_order_release);
+    return slots;
+}
+
+/*
+    int trace_hit_slot(name)
+
+    The slot counting hits of the given name, the same for every call with an equal name;
+    name must stay valid for the life of the program. Output is -1 once HIT_SLOTS names
+    are taken.
+*/
+inline int trace_hit_slot(const char* name)
+{
+    std::lock_guard<std::mutex> lock(hitMutex);
+    for(int i=0; i<hitSlotCount; i++)
+    {
+        if(strcmp(hitNames[i], name) == 0) return i;
+    }
+    if(hitSlotCount == HIT_SLOTS)
+    {
+        std::cerr << "Warning: Too many counted names; \"" << name << "\" is not counted.\n";
+        return -1;
+    }
+    hitNames[hitSlotCount] = name;
+    return hitSlotCount++;
+}
+
+/*
+    void trace_hit(slot)
+
+    Counts one hit of the name with the given slot on the calling thread. Counts are kept
+    whether or not a trace is running; tracers write the hits made during their session.
+*/
+inline void trace_hit(int slot)
+{
+    if(slot < 0) return;
+    HitSlot* block = hitCounts.blocks[slot / HIT_BLOCK].load(std::memory_order_relaxed);
+    if(!block && !(block = hitCounts.add_block(slot / HIT_BLOCK))) return;
+    std::atomic<uint64_t>& count = block[slot % HIT_BLOCK].count;
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/*
+    void trace_hit_totals(totals)
+
+    Sets totals to the hits of every slot so far, summed over all threads.
+*/
+inline void trace_hit_totals(std::vector<uint64_t>& totals)
+{
+    std::lock_guard<std::mutex> lock(hitMutex);
+    totals.assign(hitRetired, hitRetired + hitSlotCount);
+    for(HitCounts* counts = hitThreads; counts; counts = counts->next)
+    {
+        for(int b=0; b * HIT_BLOCK < hitSlotCount; b++)
+        {
+            HitSlot* block = counts->blocks[b].load(std::memory_order_acquire);
+            if(!block) continue;
+            for(int i=0; i<HIT_BLOCK && b * HIT_BLOCK + i < hitSlotCount; i++)
+            {
+                totals[b * HIT_BLOCK + i] += block[i].count.load(std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+/*
+    void trace_format_args(out, argumentNames, argumentValues)
+
+    Renders argument lists as "\"name\": value" pairs separated by commas.
+*/
+inline void trace_format_args(std::string& out, std::initializer_list<const char*> argumentNames, std::initializer_list<const char*> argumentValues)
+{
+    auto itNames  = argumentNames.begin();
+    auto itValues = argumentValues.begin();
+    for(size_t i=0; i<argumentNames.size(); i++)
+    {
+        out += '"'; out += *itNames++; out += "\": "; out += *itValues++;
+        if(i!=argumentNames.size()-1) out += ", "; //add comma if not last variable
+    }
+}
+
+/*
+    size_t trace_capture_stack(frames, depth, top)
+
+    Walks the frame pointer chain from the caller up, storing return addresses in frames.
+    Only frames between the current one and top (the end of the thread's stack) are followed,
+    each must be above the last, and the walk stops at a return address outside every loaded
+    module, so code built without frame pointers gives a short stack but never a bad read or
+    a made-up frame. Build with -fno-omit-frame-pointer for full stacks. Output is the number
+    of frames stored.
+*/
+__attribute__((noinline)) inline size_t trace_capture_stack(uintptr_t* frames, size_t depth, uintptr_t top)
+{
+    uintptr_t* fp = (uintptr_t*)__builtin_frame_address(0);
+    size_t count = 0;
+    while(count < depth && (uintptr_t)fp % sizeof(uintptr_t) == 0 && (uintptr_t)(fp + 2) <= top)
+    {
+        Dl_info info;
+        if(fp[1] == 0 || dladdr((void*)fp[1], &info) == 0) break; //Not a return address
+        frames[count++] = fp[1];
+        uintptr_t* next = (uintptr_t*)fp[0];
+        if(next <= fp) break;
+        fp = next;
+    }
+    return count;
+}
+
+/*
+    uintptr_t trace_stack_top()
+
+    Highest address of the calling thread's stack, or 0 if unknown.
+*/
+inline uintptr_t trace_stack_top()
+{
+    pthread_attr_t attributes;
+    void* base = nullptr;
+    size_t size = 0;
+    if(pthread_getattr_np(pthread_self(), &attributes) != 0) return 0;
+    pthread_attr_getstack(&attributes, &base, &size);
+    pthread_attr_destroy(&attributes);
+    return (uintptr_t)base + size;
+}
+
+/*
+    std::string trace_symbolize(address)
+
+    Name of the function a return address is in, demangled, with the offset into it; for
+    functions without a dynamic symbol (build with -rdynamic to have them) the module name and
+    offset, which addr2line can resolve.
+*/
+inline std::string trace_symbolize(uintptr_t address)
+{
+    char buffer[PATH_MAX + 64];
+    Dl_info info;
+    if(dladdr((void*)(address - 1), &info) == 0) //address - 1 is in the call instruction
+    {
+        snprintf(buffer, sizeof(buffer), "0x%" PRIxPTR, address);
+        return buffer;
+    }
+    if(info.dli_sname)
+    {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        std::string name = status == 0 && demangled ? demangled : info.dli_sname;
+        free(demangled);
+        snprintf(buffer, sizeof(buffer), "+0x%" PRIxPTR, address - (uintptr_t)info.dli_saddr);
+        return name + buffer;
+    }
+    const char* module = info.dli_fname ? strrchr(info.dli_fname, '/') : nullptr;
+    snprintf(buffer, sizeof(buffer), "%s+0x%" PRIxPTR, module ? module + 1 : (info.dli_fname ? info.dli_fname : "?"), address - (uintptr_t)info.dli_fbase);
+    return buffer;
+}
+
+/*
+    void trace_format_record(record, out, stacks)
+
+    Appends the JSON object for one record to out. stacks holds the rendered call stacks the
+    records' stack indexes refer to.
+*/
+inline void trace_format_record(const TraceRecord& r, std::string& out, const std::vector<std::string>* stacks=nullptr)
+{
+    char buffer[512];
+    int64_t ts = r.ts / 1000; //Microseconds, with the nanoseconds as three decimals
+    unsigned int ns = unsigned(r.ts % 1000);
+    int length = 0;
+    switch(r.phase)
+    {
+    case 'B':
+        length = snprintf(buffer, sizeof(buffer),
+        "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"B\", \"pid\": %i, \"tid\": %u, \"ts\": %" PRId64 ".%03u",
+        r.name, r.categories, PID_VALUE, r.tid, ts, ns);
+        break;
+    case 'E':
+        length = snprintf(buffer, sizeof(buffer),
+        "{\"ph\": \"E\", \"pid\": %i, \"tid\": %u, \"ts\": %" PRId64 ".%03u",
+        PID_VALUE, r.tid, ts, ns);
+        break;
+    case 'N':
+    case 'D':
+        length = snprintf(buffer, sizeof(buffer),
+        "{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": %i, \"tid\": %u, \"id\": %" PRIuPTR ", \"ts\": %" PRId64 ".%03u",
+        r.name, r.phase, PID_VALUE, r.tid, r.id, ts, ns);
+        break;
+    case 'i':
+        length = snprintf(buffer, sizeof(buffer),
+        "{\"name\": \"%s\", \"ph\": \"i\", \"pid\": %i, \"tid\": %u, \"s\": \"g\", \"ts\": %" PRId64 ".%03u",
+        r.name, PID_VALUE, r.tid, ts, ns);
+        break;
+    case 'M':
+        length = snprintf(buffer, sizeof(buffer),
+        "{\"name\": \"%s\", \"ph\": \"M\", \"pid\": %i, \"tid\": %u",
+        r.name, PID_VALUE, r.tid);
+        break;
+    case 'C':
+        length = snprintf(buffer, sizeof(buffer),
+        "{\"name\": \"%s\", \"ph\": \"C\", \"pid\": %i, \"tid\": %u, \"ts\": %" PRId64 ".%03u",
+        r.name, PID_VALUE, r.tid, ts, ns);
+        break;
+    case 's':
+    case 'f': //Flow ends bind to the span around them
+        length = snprintf(buffer, sizeof(buffer),
+        "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"%c\", %s\"pid\": %i, \"tid\": %u, \"id\": %" PRIuPTR ", \"ts\": %" PRId64 ".%03u",
+        r.name, r.categories, r.phase, r.phase == 'f' ? "\"bp\": \"e\", " : "", PID_VALUE, r.tid, r.id, ts, ns);
+        break;
+    }
+    if(length >= int(sizeof(buffer))) length = sizeof(buffer) - 1; //Truncated by a very long name
+    out.append(buffer, length);
+    if(r.value != COUNTER_NONE)
+    {
+        if(r.value == COUNTER_INT)
+        {
+            length = snprintf(buffer, sizeof(buffer), ", \"args\": { \"value\": %" PRId64 "} }", int64_t(r.id));
+        }
+        else
+        {
+            double value;
+            uint64_t bits = r.id;
+            memcpy(&value, &bits, sizeof(value));
+            length = snprintf(buffer, sizeof(buffer), ", \"args\": { \"value\": %.17g} }", std::isfinite(value) ? value : 0.0);
+        }
+        out.append(buffer, length);
+    }
+    else if(r.stack != 0 && stacks && r.stack <= stacks->size())
+    {
+        out += ", \"args\": { "; out += r.args; out += r.args.empty() ? "" : ", ";
+        out += "\"stack\": "; out += (*stacks)[r.stack - 1]; out += "} }";
+    }
+    else if(r.phase == 'C' || r.phase == 'M' || !r.args.empty())
+    {
+        out += ", \"args\": { "; out += r.args; out += "} }";
+    }
+    else out += '}';
+}
+
+/*
+    class Tracer
+
+    One independent trace: its own output file and writer, per-thread buffers, format pool,
+    session state and settings. Several tracers can record at the same time into different
+    files with different buffer sizes and sampling rates. The trace_* free functions act on
+    defaultTracer.
+
+    Settings (set_*) take effect at the next start(). A Tracer must not be destroyed while
+    other threads are still recording into it.
+*/
+class Tracer
+{
+public:
+    Tracer();
+    ~Tracer();
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    void set_process_name(const char* name);
+    void set_writer(int backend);
+    void set_shm_size(size_t bytes);
+    void set_buffer_size(size_t records);
+    void set_memory_budget(size_t bytes);
+    void set_sample_rate(unsigned int rate);
+    void set_output_format(int format);
+    void set_compression(int mode);
+    void set_counter_interval(unsigned int microseconds);
+    void set_min_duration(const char* name, unsigned int nanoseconds);
+    void set_stack_capture(const char* name, bool enabled);
+    void set_sched_stats(bool enabled);
+    void set_kernel_markers(bool enabled);
+    void set_hit_interval(unsigned int milliseconds);
+    void set_static_strings(bool enabled);
+
+    bool start(const char* filename);
+    void flush();
+    void end();
+    bool active() const { return traceActive.load(); }
+    int64_t start_time() const { return startTime; }
+    int64_t span_overhead() const { return spanOverhead; }
+    int64_t event_overhead() const { return eventOverhead; }
+
+    void event_start(const char* name, const char* categories, const unsigned int tid=TID_VALUE);
+    void event_start(const char* name, const char* categories, std::initializer_list<const char*> argumentNames, std::initializer_list<const char*> argumentValues, const unsigned int tid=TID_VALUE);
+    void event_end(const unsigned int tid=TID_VALUE);
+    void event_end(std::initializer_list<const char*> argumentNames, std::initializer_list<const char*> argumentValues, const unsigned int tid=TID_VALUE);
+    void object_new(const char* name, const void* obj_pointer, const unsigned int tid=TID_VALUE);
+    void object_gone(const char* name, const void* obj_pointer, const unsigned int tid=TID_VALUE);
+    void instant_global(const char* name, const unsigned int tid=TID_VALUE);
+    void counter(const char* name, std::initializer_list<const char*> key, std::initializer_list<const char*> value, const unsigned int tid=TID_VALUE);
+    void counter_int(const char* name, int64_t value, const unsigned int tid=TID_VALUE);
+    void counter_double(const char* name, double value, const unsigned int tid=TID_VALUE);
+    TraceReservation reserve(size_t count, const unsigned int tid=TID_VALUE);
+    void record_batch(const BatchEvent* events, size_t count);
+    SpanContext context_capture(const unsigned int tid=TID_VALUE);
+    SpanContext context_restore(const SpanContext& context);
+    void signal_prepare(size_t records=SIGNAL_RING_RECORDS);
+    void signal_event_start(const char* name, const char* categories, const unsigned int tid=TID_VALUE);
+    void signal_event_end(const unsigned int tid=TID_VALUE);
+    void signal_instant(const char* name, const unsigned int tid=TID_VALUE);
+    void set_crash_handler(bool enabled);
+
+private:
+    friend struct Recording;
+    friend struct ThreadSlots;
+    friend class TraceReservation;
+
+    ThreadBuffer& thread_buffer();
+    ThreadBuffer& attach_thread();
+    void release_thread(ThreadBuffer* buffer);
+    const char* intern(ThreadBuffer& buffer, const char* text);
+    TraceRecord& record(ThreadBuffer& buffer, char phase, const char* name, const char* categories, const unsigned int tid, uintptr_t id=0, int64_t ts=0);
+    void reserve_records(ThreadBuffer& buffer, size_t count);
+    void grant_buffer(ThreadBuffer& buffer, unsigned int epoch);
+    void adapt_buffer(ThreadBuffer& buffer);
+    size_t budget_take(ThreadBuffer& buffer, size_t wanted, int64_t now);
+    void budget_reclaim(ThreadBuffer& buffer, int64_t now);
+    bool span_sampled(ThreadBuffer& buffer);
+    bool span_end_sampled(ThreadBuffer& buffer);
+    void counter_sample(ThreadBuffer& buffer, const char* name, char value, uint64_t bits, const unsigned int tid);
+    void pending_counters(ThreadBuffer& buffer, std::vector<TraceRecord>& out);
+    void span_opened(ThreadBuffer& buffer);
+    bool span_closed(ThreadBuffer& buffer, OpenSpan& span);
+    bool span_elided(ThreadBuffer& buffer, const OpenSpan& span, int64_t now);
+    void sched_args(ThreadBuffer& buffer, const OpenSpan& span, int64_t now, std::string& args);
+    void context_opened(ThreadBuffer& buffer, const unsigned int tid);
+    void kernel_marker(char phase, const char* name);
+    void open_kernel_markers();
+    void collect_elided(ThreadBuffer& buffer);
+    void elided_summary(std::vector<TraceRecord>& out);
+    void hit_summary(std::vector<TraceRecord>& out);
+    void signal_record(char phase, const char* name, const char* categories, const unsigned int tid);
+    void signal_write(SignalRing& ring, char phase, const char* name, const char* categories, const unsigned int tid);
+    void signal_drain(std::vector<TraceRecord>& out);
+    void install_crash_handler();
+    void remove_crash_handler();
+    void crash_dump(int sig);
+    static void crash_handler(int sig, siginfo_t* info, void* context);
+    void capture_stack(ThreadBuffer& buffer, TraceRecord& record);
+    void render_stacks();
+    void process_name();
+    void calibrate();
+    void measure_overhead();
+    void write_index();
+    void write_batch(const std::vector<const TraceRecord*>& batch);
+    void merge_streams(const std::vector<std::vector<TraceRecord>*>& streams, int64_t watermark);
+    void flush_streams(std::vector<std::vector<TraceRecord>>& streams, int64_t watermark);
+    int64_t collect_streams(std::vector<std::vector<TraceRecord>>& streams);
+    void retire(ThreadBuffer& buffer, int64_t floor=INT64_MAX);
+
+    const uint64_t uid;
+
+    //Session
+    std::atomic<bool> traceActive{false};
+    std::atomic<unsigned int> traceEpoch{0}; //Bumped by every start and end
+    std::mutex sessionMutex; //Serializes start and end
+    int64_t startTime = 0; //Clock base of the current session
+    int64_t spanOverhead = 0; //Nanoseconds an empty span measures, from calibrate()
+    int64_t eventOverhead = 0; //Nanoseconds one recording call takes
+
+    //Settings
+    int writerBackend = TRACE_WRITER_PWRITE;
+    size_t shmSize = SHM_SIZE;
+    std::string processName; //Empty means the executable's name
+    size_t bufferSize = TRACE_MAX; //Records per thread buffer, the cap on one under a memory budget
+    size_t memoryBudget = 0; //Bytes of records for all buffers, or 0 for bufferSize each
+    unsigned int sampleRate = 1; //Record one top-level span in every sampleRate
+    int outputFormat = TRACE_FORMAT_JSON;
+    int compression = -1; //TRACE_COMPRESS_*, or -1 to go by the file name
+    int64_t counterInterval = 0; //Nanoseconds between records of one numeric counter
+    struct MinDuration
+    {
+        std::string name;
+        int64_t threshold; //Nanoseconds
+        std::string summary; //Name of the counter with the elided spans
+    };
+    std::vector<MinDuration> minDurations;
+    std::vector<std::string> stackNames; //Names of the events that capture their call stack
+    bool schedStats = false; //Break spans down into on-CPU, runqueue and off-CPU time
+    bool kernelMarkers = false; //Mirror span starts and ends into ftrace's trace_marker
+    bool staticStrings = false; //Record the callers' name and category pointers without copying
+
+    //Output
+    bool firstRecord = true; //No record written yet, so no separator is needed
+    bool indexed = false; //Output is uncompressed, so chunks are indexed
+    std::vector<ChunkEntry> chunks;
+    std::vector<TraceRecord> held; //Records past the last flush's watermark, written by the next; under flushMutex
+    std::mutex flushMutex; //Serializes collecting records and writing them to the trace file
+    FormatPool formatPool;
+    TraceWriter traceWriter;
+
+    //Buffers
+    std::mutex bufferMutex; //Guards liveBuffers, retiredStreams, retiredRecords and the memory budget
+    std::vector<ThreadBuffer*> liveBuffers;
+    std::vector<std::vector<TraceRecord>> retiredStreams;
+    size_t retiredRecords = 0;
+    size_t retiredLimit = RETIRED_MAX; //retiredRecords that trigger a flush
+    size_t heldLimit = 2 * RETIRED_MAX; //held records past which the oldest are written out of order
+    int64_t budgetFree = 0; //Records of the memory budget not granted to a buffer, negative when overrun
+    std::vector<ElidedSpans> elidedTotals; //Spans elided by threads that exited or were collected
+
+    //Strings
+    std::mutex internMutex; //Guards internedStrings
+    std::unordered_set<std::string> internedStrings; //Copies of the names and categories recorded, kept until the tracer is destroyed
+
+    //Call stacks
+    std::mutex stackMutex; //Guards stackIndex and stackFrames
+    std::unordered_map<uint64_t, uint32_t> stackIndex; //Stack hash to index in stackFrames
+    std::vector<std::vector<uintptr_t>> stackFrames; //Every distinct stack captured
+    std::vector<std::string> stackText; //stackFrames rendered as JSON arrays; under flushMutex
+
+    //Span contexts
+    std::atomic<uint64_t> nextContextId{1}; //Span and flow ids
+
+    //Kernel markers
+    int markerFd = -1; //trace_marker while the session mirrors spans into it
+
+    //Hit counts
+    int64_t hitInterval = 0; //Milliseconds between flushes of the hit counts, or 0 for none
+    std::vector<uint64_t> hitBase; //Totals by slot when the session started; under bufferMutex
+    std::vector<uint64_t> hitWritten; //Hits by slot last written; under bufferMutex
+    std::thread hitTimer; //Flushes every hitInterval while the session runs
+    std::mutex timerMutex; //Guards timerStop
+    std::condition_variable timerWake;
+    bool timerStop = false;
+
+    //Signal-safe recording
+    std::atomic<SignalRing*> signalRings{nullptr}; //Every ring of the tracer, newest first
+    uint64_t signalDropped = 0; //Records the rings dropped this session; under bufferMutex
+    bool crashHandler = false; //Dump the signal rings when the program crashes
+    bool crashInstalled = false;
+    char crashPath[PATH_MAX + 8]; //Where crash_dump writes, set by start()
+    struct sigaction crashPrevious[5]; //Actions replaced for CRASH_SIGNALS
+};
+
+inline ThreadSlots::~ThreadSlots()
+{
+    std::lock_guard<std::mutex> lock(tracerRegistryMutex);
+    for(auto& slot : slots)
+    {
+        for(Tracer* tracer : tracerRegistry)
+        {
+            if(tracer->uid == slot.first)
+            {
+                tracer->release_thread(slot.second);
+                break;
+            }
+        }
+    }
+}
+
+/*
+    struct Recording
+
+    Guard taken by every recording call. It marks the thread busy and only then checks
+    traceActive, both sequentially consistent, while end() clears traceActive and then waits
+    for every busy thread. So either the call sees tracing stopped and leaves its buffer alone,
+    or end() waits for it to finish: the fast path never takes a lock.
+    A buffer left over from an earlier session is reset on its first use in a new one, and a
+    closed one is opened: its oldest is set to the clock before the call reads it, through
+    INT64_MIN so that a flush reading oldest meanwhile waits for the time.
+*/
+struct Recording
+{
+    ThreadBuffer& buffer;
+    bool active;
+
+    explicit Recording(Tracer& tracer) : buffer(tracer.thread_buffer())
+    {
+        while(buffer.busy.fetch_add(1) >= BUSY_STOLEN) //Nested calls count up
+        {
+            buffer.busy.fetch_sub(1); //A flush is taking the records; wait for it
+            while(buffer.busy.load() >= BUSY_STOLEN) std::this_thread::yield();
+        }
+        active = tracer.traceActive.load();
+        unsigned int epoch = tracer.traceEpoch.load(std::memory_order_relaxed);
+        if(active && buffer.epoch != epoch)
+        {
+            buffer.records.clear();
+            buffer.counters.clear();
+            buffer.spans.clear();
+            buffer.elided.clear();
+            buffer.lastFilterName = nullptr;
+            buffer.lastStackName = nullptr;
+            buffer.spanIds.clear();
+            buffer.adopted = SpanContext();
+            buffer.depth = buffer.skipDepth = buffer.topSpans = 0;
+            buffer.oldest.store(INT64_MAX);
+            tracer.grant_buffer(buffer, epoch);
+        }
+        if(active && buffer.oldest.load(std::memory_order_relaxed) == INT64_MAX)
+        {
+            buffer.oldest.store(INT64_MIN);
+            buffer.oldest.store(trace_timestamp());
+        }
+    }
+
+    ~Recording()
+    {
+        buffer.busy.store(buffer.busy.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+    }
+};
+
+inline Tracer::Tracer() : uid(nextTracerUid++)
+{
+    std::lock_guard<std::mutex> lock(tracerRegistryMutex);
+    tracerRegistry.push_back(this);
+}
+
+inline Tracer::~Tracer()
+{
+    {
+        std::lock_guard<std::mutex> lock(tracerRegistryMutex);
+        tracerRegistry.erase(std::find(tracerRegistry.begin(), tracerRegistry.end(), this));
+    }
+    end();
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    for(ThreadBuffer* buffer : liveBuffers) delete buffer;
+    for(SignalRing* ring = signalRings.load(); ring; )
+    {
+        SignalRing* next = ring->next;
+        delete ring;
+        ring = next;
+    }
+}
+
+/*
+    ThreadBuffer& Tracer::thread_buffer()
+
+    The calling thread's buffer in this tracer, created on first use.
+*/
+inline ThreadBuffer& Tracer::thread_buffer()
+{
+    if(threadSlots.lastUid == uid) return *threadSlots.last;
+    for(auto& slot : threadSlots.slots)
+    {
+        if(slot.first == uid)
+        {
+            threadSlots.lastUid = uid;
+            threadSlots.last = slot.second;
+            return *slot.second;
+        }
+    }
+    return attach_thread();
+}
+
+inline ThreadBuffer& Tracer::attach_thread()
+{
+    ThreadBuffer* buffer = new ThreadBuffer();
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        liveBuffers.push_back(buffer);
+    }
+    threadSlots.slots.push_back(std::make_pair(uid, buffer));
+    threadSlots.lastUid = uid;
+    threadSlots.last = buffer;
+    return *buffer;
+}
+
+/*
+    void Tracer::release_thread(buffer)
+
+    Called as a thread exits: its remaining records become a retired stream.
+*/
+inline void Tracer::release_thread(ThreadBuffer* buffer)
+{
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    liveBuffers.erase(std::find(liveBuffers.begin(), liveBuffers.end(), buffer));
+    if(buffer->signalRing)
+    {
+        for(SignalSlot& slot : signalSlots)
+        {
+            if(slot.uid.load(std::memory_order_relaxed) == uid) slot.uid.store(0); //No more handlers write to it
+        }
+        buffer->signalRing->owned.store(false); //Drained with the others, then reused
+    }
+    if(buffer->epoch == traceEpoch.load())
+    {
+        if(memoryBudget) budgetFree += int64_t(buffer->limit.load()); //Its share goes back to the threads still recording
+        std::vector<TraceRecord> pending;
+        pending_counters(*buffer, pending);
+        if(!pending.empty()) retiredStreams.push_back(std::move(pending));
+        collect_elided(*buffer);
+        if(!buffer->records.empty())
+        {
+            retiredRecords += buffer->records.size();
+            retiredStreams.push_back(std::move(buffer->records));
+        }
+    }
+    delete buffer;
+}
+
+/*
+    void Tracer::set_process_name(name)
+
+    Name shown for this process by the viewer and by trace_merge; defaults to the name of the
+    executable.
+*/
+inline void Tracer::set_process_name(const char* name)
+{
+    processName = name;
+}
+
+/*
+    void Tracer::set_writer(backend)
+
+    Selects how trace output is written, TRACE_WRITER_PWRITE (default), TRACE_WRITER_URING or
+    TRACE_WRITER_SHM.
+*/
+inline void Tracer::set_writer(int backend)
+{
+    writerBackend = backend;
+}
+
+/*
+    void Tracer::set_shm_size(bytes)
+
+    Size of the shared-memory ring used by TRACE_WRITER_SHM, rounded up to a power of two.
+*/
+inline void Tracer::set_shm_size(size_t bytes)
+{
+    shmSize = bytes;
+}
+
+/*
+    void Tracer::set_buffer_size(records)
+
+    Records a thread buffers before it is retired for writing; TRACE_MAX by default.
+*/
+inline void Tracer::set_buffer_size(size_t records)
+{
+    bufferSize = records > 0 ? records : 1;
+}
+
+/*
+    void Tracer::set_memory_budget(bytes)
+
+    Bounds the records held in memory, across every thread, to about bytes; 0 (the default)
+    turns this off and gives each thread set_buffer_size records. A quarter of the budget holds
+    the retired buffers waiting to be flushed and the rest is shared out among the threads
+    recording, in proportion to how fast they record: each starts with BUDGET_START_RECORDS,
+    and every time its buffer fills it is resized to hold about BUDGET_FILL_NS of its events,
+    at most 4 times larger or smaller per step, between BUDGET_MIN_RECORDS and the buffer size.
+    A thread whose buffer takes longer than that to fill gives records back; when a busy thread
+    finds the budget used up, threads that have not filled their buffer in 4 times as long are
+    shrunk for it. A thread always keeps BUDGET_MIN_RECORDS, so many threads can overrun a
+    small budget by that much each. The records a flush holds back to keep the trace in time
+    order are outside the budget; they are bounded by the buffer size alone (see
+    merge_streams).
+*/
+inline void Tracer::set_memory_budget(size_t bytes)
+{
+    memoryBudget = bytes;
+}
+
+/*
+    void Tracer::grant_buffer(buffer, epoch)
+
+    Moves a buffer into the session of the given epoch and sets how many records it holds.
+*/
+inline void Tracer::grant_buffer(ThreadBuffer& buffer, unsigned int epoch)
+{
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    buffer.epoch = epoch;
+    buffer.filledSince = trace_timestamp();
+    if(!memoryBudget)
+    {
+        buffer.limit.store(bufferSize, std::memory_order_relaxed);
+        return;
+    }
+    size_t floor = std::min(bufferSize, BUDGET_MIN_RECORDS);
+    size_t granted = budget_take(buffer, std::min(bufferSize, BUDGET_START_RECORDS), buffer.filledSince);
+    if(granted < floor) //Over budget rather than unable to record
+    {
+        budgetFree -= int64_t(floor - granted);
+        granted = floor;
+    }
+    buffer.limit.store(granted, std::memory_order_relaxed);
+}
+
+/*
+    void Tracer::adapt_buffer(buffer)
+
+    Resizes a buffer that just filled to hold BUDGET_FILL_NS of records at the rate it filled,
+    within the memory budget. Caller holds bufferMutex.
+*/
+inline void Tracer::adapt_buffer(ThreadBuffer& buffer)
+{
+    int64_t now = trace_timestamp();
+    int64_t elapsed = std::max<int64_t>(now - buffer.filledSince, 1);
+    buffer.filledSince = now;
+    size_t limit = buffer.limit.load(std::memory_order_relaxed);
+    double scale = std::min(std::max(double(BUDGET_FILL_NS) / elapsed, 0.25), 4.0);
+    size_t wanted = std::min(std::max(size_t(limit * scale), std::min(bufferSize, BUDGET_MIN_RECORDS)), bufferSize);
+    if(wanted > limit) wanted = limit + budget_take(buffer, wanted - limit, now);
+    else budgetFree += int64_t(limit - wanted);
+    buffer.limit.store(wanted, std::memory_order_relaxed);
+}
+
+/*
+    size_t Tracer::budget_take(buffer, wanted, now)
+
+    Takes up to wanted records from the memory budget for a buffer, shrinking idle buffers
+    first if the budget has too few left. Returns how many it got. Caller holds bufferMutex.
+*/
+inline size_t Tracer::budget_take(ThreadBuffer& buffer, size_t wanted, int64_t now)
+{
+    if(budgetFree < int64_t(wanted)) budget_reclaim(buffer, now);
+    size_t taken = size_t(std::min(int64_t(wanted), std::max<int64_t>(budgetFree, 0)));
+    budgetFree -= int64_t(taken);
+    return taken;
+}
+
+/*
+    void Tracer::budget_reclaim(buffer, now)
+
+    Returns to the memory budget three quarters of every other buffer in the session that has
+    not filled for 4 times BUDGET_FILL_NS. Their owners see the lower limit at their next
+    record, retiring what they hold if it is over. Caller holds bufferMutex.
+*/
+inline void Tracer::budget_reclaim(ThreadBuffer& buffer, int64_t now)
+{
+    size_t floor = std::min(bufferSize, BUDGET_MIN_RECORDS);
+    for(ThreadBuffer* other : liveBuffers)
+    {
+        if(other == &buffer || other->epoch != traceEpoch.load()) continue;
+        size_t limit = other->limit.load(std::memory_order_relaxed);
+        if(limit <= floor || now - other->filledSince < 4 * BUDGET_FILL_NS) continue;
+        size_t smaller = std::max(floor, limit / 4);
+        other->limit.store(smaller, std::memory_order_relaxed);
+        budgetFree += int64_t(limit - smaller);
+    }
+}
+
+/*
+    void Tracer::set_sample_rate(rate)
+
+    Record only one in every rate top-level spans on each thread, together with everything
+    nested in it; 1 (the default) records all of them. Other events are not sampled.
+*/
+inline void Tracer::set_sample_rate(unsigned int rate)
+{
+    sampleRate = rate > 0 ? rate : 1;
+}
+
+/*
+    void Tracer::set_output_format(format)
+
+    TRACE_FORMAT_JSON (default) writes a JSON array whose closing bracket is rewritten in place
+    after every flush, so the file parses at any point, even if the process dies.
+    TRACE_FORMAT_JSONL writes one object per line and no array, for tools that tail the trace
+    (trace_merge and the other tools read both).
+*/
+inline void Tracer::set_output_format(int format)
+{
+    outputFormat = format;
+}
+
+/*
+    void Tracer::set_compression(mode)
+
+    TRACE_COMPRESS_NONE, TRACE_COMPRESS_GZIP or TRACE_COMPRESS_ZSTD. Unless set, output is
+    compressed when the file name ends in ".gz" or ".zst"; the viewer opens .json.gz directly.
+    A compressed JSON array is only closed by trace_end, so pair compression with
+    TRACE_FORMAT_JSONL if the file has to be readable while it is written.
+*/
+inline void Tracer::set_compression(int mode)
+{
+    compression = mode;
+}
+
+/*
+    bool Tracer::start(filename)
+
+    Starts the trace procedure. This includes opening the file (only written to on closing
+    or exceeding the memory however); each thread allocates its own buffer as it records.
+
+    Output is true if successful, false otherwise.
+*/
+inline void trace_apply_disable_list();
+
+inline bool Tracer::start(const char* filename)
+{
+    trace_apply_disable_list();
+    std::lock_guard<std::mutex> session(sessionMutex);
+    if(traceActive)
+    {
+        std::cerr << "Error: Trace already started; call trace_end first.\n";
+        return 0;
+    }
+    std::unique_lock<std::mutex> lock(flushMutex);
+    int compress = compression;
+    if(compress < 0)
+    {
+        size_t length = strlen(filename);
+        compress = TRACE_COMPRESS_NONE;
+        if(length > 3 && strcmp(filename + length - 3, ".gz") == 0) compress = TRACE_COMPRESS_GZIP;
+        if(length > 4 && strcmp(filename + length - 4, ".zst") == 0) compress = TRACE_COMPRESS_ZSTD;
+    }
+    if(traceWriter.open(filename, writerBackend, shmSize, compress))
+    {
+        bool ok = true;
+        if(outputFormat == TRACE_FORMAT_JSON) //Opening brace of JSON, closed in place from the start
+        {
+            ok = traceWriter.append("[\n", 2) && traceWriter.write_trailer("\n]", 2);
+        }
+        if(!ok)
+        {
+            std::cerr << "Error: Unable to write to file \"" << filename << "\" for trace output.\n";
+        }
+        firstRecord = true;
+        indexed = compress == TRACE_COMPRESS_NONE;
+        chunks.clear();
+        held.clear();
+    }
+    else
+    {
+        std::cerr << "Error: Unable to open file \"" << filename << "\" for trace output.\n";
+        return 0;
+    }
+    PID_VALUE = getpid();
+    startTime = trace_timestamp();
+    unsigned int threads = std::thread::hardware_concurrency();
+    if(threads > FORMAT_THREADS) threads = FORMAT_THREADS;
+    if(threads > 1) formatPool.start(threads-1); //The flushing thread makes up the rest
+    if(kernelMarkers) open_kernel_markers();
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        retiredLimit = memoryBudget ? std::max<size_t>(memoryBudget / 4 / sizeof(TraceRecord), 1) : std::max(RETIRED_MAX, 4 * bufferSize);
+        heldLimit = 2 * std::max(RETIRED_MAX, 4 * bufferSize); //Not from the budget, which would make it too small to keep order
+        budgetFree = int64_t(memoryBudget - memoryBudget / 4) / int64_t(sizeof(TraceRecord));
+        trace_hit_totals(hitBase);
+        hitWritten.assign(hitBase.size(), 0);
+        signalDropped = 0;
+    }
+    lock.unlock(); //The records below may fill a buffer and flush
+    traceEpoch++;
+    traceActive = true;
+    process_name();
+    calibrate();
+    if(crashHandler)
+    {
+        snprintf(crashPath, sizeof(crashPath), "%s.crash", filename);
+        install_crash_handler();
+    }
+    if(hitInterval > 0)
+    {
+        timerStop = false;
+        hitTimer = std::thread([this]
+        {
+            std::unique_lock<std::mutex> lock(timerMutex);
+            while(!timerWake.wait_for(lock, std::chrono::milliseconds(hitInterval), [this]{ return timerStop; }))
+            {
+                lock.unlock();
+                flush();
+                lock.lock();
+            }
+        });
+    }
+    return 1;
+}
+
+/*
+    void Tracer::write_batch(batch)
+
+    Formats a batch of records in chunks of FORMAT_CHUNK on the pool and writes the chunks in
+    order with one vectored write. In TRACE_FORMAT_JSON the closing bracket is then written
+    again after them, to be overwritten by the next batch. Each batch becomes one entry of the
+    chunk index. Caller holds flushMutex.
+*/
+inline void Tracer::write_batch(const std::vector<const TraceRecord*>& batch)
+{
+    if(batch.empty() || !traceWriter.is_open()) return;
+
+    render_stacks();
+    size_t tasks = (batch.size() + FORMAT_CHUNK - 1) / FORMAT_CHUNK;
+    std::vector<std::string> text(tasks);
+    std::vector<std::vector<std::pair<unsigned int, size_t>>> threads(tasks); //First record of each tid in each task's text
+    formatPool.run(tasks, [&](size_t task)
+    {
+        size_t begin = task * FORMAT_CHUNK;
+        size_t end = std::min(begin + FORMAT_CHUNK, batch.size());
+        std::string& out = text[task];
+        out.reserve((end - begin) * 96);
+        std::unordered_map<unsigned int, size_t> seen;
+        for(size_t i=begin; i<end; i++)
+        {
+            if(indexed && seen.insert(std::make_pair(batch[i]->tid, out.size())).second)
+            {
+                threads[task].push_back(std::make_pair(batch[i]->tid, out.size()));
+            }
+            if(outputFormat == TRACE_FORMAT_JSON) out += ",\n";
+            trace_format_record(*batch[i], out, &stackText);
+            if(outputFormat == TRACE_FORMAT_JSONL) out += '\n';
+        }
+    });
+
+    std::vector<struct iovec> iov(tasks);
+    for(size_t i=0; i<tasks; i++)
+    {
+        iov[i].iov_base = &text[i][0];
+        iov[i].iov_len = text[i].size();
+    }
+    size_t skipped = 0;
+    bool first = firstRecord;
+    if(firstRecord && outputFormat == TRACE_FORMAT_JSON) //The very first record has no separator before it
+    {
+        iov[0].iov_base = (char*)iov[0].iov_base + 2;
+        iov[0].iov_len -= 2;
+        skipped = 2;
+    }
+    firstRecord = false;
+
+    if(indexed)
+    {
+        ChunkEntry chunk;
+        chunk.offset = traceWriter.offset();
+        chunk.length = 0;
+        chunk.first = INT64_MAX;
+        chunk.last = INT64_MIN;
+        chunk.records = batch.size();
+        chunk.metadata = 0;
+        for(const TraceRecord* r : batch)
+        {
+            if(r->phase == 'M' && ++chunk.metadata) continue; //Written without a timestamp
+            chunk.first = std::min(chunk.first, r->ts);
+            chunk.last = std::max(chunk.last, r->ts);
+        }
+        std::unordered_map<unsigned int, uint64_t> seen;
+        uint64_t base = chunk.offset;
+        for(size_t i=0; i<tasks; i++)
+        {
+            for(auto const& thread : threads[i])
+            {
+                uint64_t at = base + (thread.second > skipped ? thread.second - skipped : 0);
+                if(seen.insert(std::make_pair(thread.first, at)).second) chunk.threads.push_back(std::make_pair(thread.first, at));
+            }
+            base += iov[i].iov_len; //iov[0] already leaves out the skipped separator
+            skipped = 0;
+        }
+        chunk.length = base - chunk.offset;
+        std::sort(chunk.threads.begin(), chunk.threads.end());
+        chunks.push_back(std::move(chunk));
+    }
+    uint64_t before = traceWriter.offset();
+    bool ok = traceWriter.append(iov.data(), iov.size());
+    if(ok && traceWriter.offset() == before) //Dropped whole by a full shared-memory ring
+    {
+        firstRecord = first;
+        if(indexed) chunks.pop_back();
+    }
+    if(ok && outputFormat == TRACE_FORMAT_JSON) ok = traceWriter.write_trailer("\n]", 2);
+    if(!ok)
+    {
+        std::cerr << "Error: Unable to write trace output.\n";
+    }
+}
+
+/*
+    void Tracer::merge_streams(streams, watermark)
+
+    k-way merge of time-ordered record streams through a min-heap on timestamp, handing the
+    result to write_batch every MERGE_BATCH records so the merged trace is never held in
+    memory. Ties keep the order of the streams. Records at or past watermark are kept in held
+    for the next flush instead, unless more than heldLimit of them would be; then the oldest
+    are written anyway, and may come before records that threads buffered earlier. Caller holds
+    flushMutex.
+*/
+inline void Tracer::merge_streams(const std::vector<std::vector<TraceRecord>*>& streams, int64_t watermark)
+{
+    typedef std::pair<int64_t, size_t> Head; //Timestamp of the next record, stream index
+    std::vector<Head> heap;
+    std::vector<size_t> next(streams.size(), 0);
+    size_t left = 0;
+    heap.reserve(streams.size());
+    for(size_t i=0; i<streams.size(); i++)
+    {
+        if(!streams[i]->empty()) heap.push_back(Head((*streams[i])[0].ts, i));
+        left += streams[i]->size();
+    }
+    std::make_heap(heap.begin(), heap.end(), std::greater<Head>());
+
+    std::vector<const TraceRecord*> batch;
+    batch.reserve(MERGE_BATCH);
+    std::vector<TraceRecord> later;
+    while(!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<Head>());
+        size_t stream = heap.back().second;
+        TraceRecord& record = (*streams[stream])[next[stream]++];
+        if(record.ts < watermark || left > heldLimit) batch.push_back(&record);
+        else later.push_back(std::move(record));
+        left--;
+        if(next[stream] < streams[stream]->size())
+        {
+            heap.back().first = (*streams[stream])[next[stream]].ts;
+            std::push_heap(heap.begin(), heap.end(), std::greater<Head>());
+        }
+        else heap.pop_back();
+
+        if(batch.size() == MERGE_BATCH)
+        {
+            write_batch(batch);
+            batch.clear();
+        }
+    }
+    write_batch(batch);
+    held.swap(later);
+}
+
+/*
+    void Tracer::flush_streams(streams, watermark)
+
+    Merges streams that no thread appends to any more with the records held by the last flush,
+    writes those before watermark, then frees the streams. Caller holds flushMutex.
+*/
+inline void Tracer::flush_streams(std::vector<std::vector<TraceRecord>>& streams, int64_t watermark)
+{
+    std::vector<std::vector<TraceRecord>*> pointers;
+    pointers.reserve(streams.size() + 1);
+    pointers.push_back(&held);
+    for(auto& stream : streams) pointers.push_back(&stream);
+    merge_streams(pointers, watermark);
+    streams.clear();
+}
+
+/*
+    int64_t Tracer::collect_streams(streams)
+
+    Adds the retired streams to streams, the records published in the signal rings, and the
+    records of every thread of the session that is not inside a recording call, closing their
+    buffers. Output is the watermark: the earliest timestamp a thread still inside a call, or a
+    signal handler still writing, may yet record, or the time now if none can. Every record
+    collected from now on is at or past it, so a flush that writes only the records before it
+    keeps the whole trace in time order. That excludes records with caller timestamps older
+    than the call (trace_reserve, trace_record_batch). Caller holds flushMutex and bufferMutex.
+*/
+inline int64_t Tracer::collect_streams(std::vector<std::vector<TraceRecord>>& streams)
+{
+    for(auto& stream : retiredStreams) streams.push_back(std::move(stream));
+    retiredStreams.clear();
+    retiredRecords = 0;
+    std::vector<TraceRecord> pending;
+    int64_t watermark = trace_timestamp();
+    //A handler that starts writing after this reads a later clock; one already writing may
+    //publish after the drain below, but no earlier than it started
+    for(SignalRing* ring = signalRings.load(); ring; ring = ring->next)
+    {
+        if(ring->writing.load() == 0) continue;
+        int64_t since;
+        while((since = ring->since.load()) == INT64_MIN) std::this_thread::yield(); //Being set
+        watermark = std::min(watermark, since);
+    }
+    streams.push_back(std::vector<TraceRecord>());
+    signal_drain(streams.back());
+    for(ThreadBuffer* buffer : liveBuffers)
+    {
+        if(buffer->epoch != traceEpoch.load()) continue;
+        unsigned int idle = 0;
+        if(buffer->busy.compare_exchange_strong(idle, BUSY_STOLEN))
+        {
+            if(buffer->oldest.load(std::memory_order_relaxed) != INT64_MAX)
+            {
+                pending_counters(*buffer, pending);
+                if(!buffer->records.empty())
+                {
+                    streams.push_back(std::move(buffer->records));
+                    buffer->records.clear();
+                    buffer->generation++;
+                }
+                buffer->oldest.store(INT64_MAX, std::memory_order_relaxed);
+            }
+            buffer->busy.fetch_sub(BUSY_STOLEN, std::memory_order_release);
+            continue;
+        }
+        int64_t oldest;
+        while((oldest = buffer->oldest.load()) == INT64_MIN) std::this_thread::yield(); //Being opened
+        watermark = std::min(watermark, oldest);
+    }
+    std::sort(pending.begin(), pending.end(), [](const TraceRecord& a, const TraceRecord& b){ return a.ts < b.ts; });
+    streams.push_back(std::move(pending));
+    return watermark;
+}
+
+/*
+    void Tracer::flush()
+
+    Flush the buffered records; that is, merge them by timestamp, dump them to the file and empty
+    the buffers. This covers the buffers retired by full or exited threads, the calling
+    thread's own buffer and those of threads not inside a recording call. Records from a thread
+    still inside one that are no older than what it may yet record are held for the next
+    flush, so the trace stays in time order across flushes (see collect_streams); end() writes
+    everything. Safe to call while other threads record.
+*/
+inline void Tracer::flush()
+{
+    Recording recording(*this); //Keeps end() from taking our buffer at the same time
+    if(!recording.active) return;
+    ThreadBuffer& buffer = recording.buffer;
+    std::lock_guard<std::mutex> lock(flushMutex);
+    std::vector<std::vector<TraceRecord>> streams(1);
+    pending_counters(buffer, streams.back());
+    if(!buffer.records.empty())
+    {
+        streams.push_back(std::move(buffer.records));
+        buffer.records.clear();
+        buffer.generation++;
+    }
+    buffer.oldest.store(trace_timestamp());
+    int64_t watermark;
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        streams.push_back(std::vector<TraceRecord>());
+        hit_summary(streams.back());
+        watermark = collect_streams(streams);
+    }
+    flush_streams(streams, watermark);
+}
+
+/*
+    void Tracer::retire(buffer, floor)
+
+    Moves a full thread buffer to the retired streams, flushing them once there are more than
+    RETIRED_MAX records waiting (or a quarter of the memory budget's worth). Under a memory
+    budget the buffer is then resized for its event rate. floor is the timestamp of a record
+    the caller is about to add, if it read the clock before retiring; the buffer's oldest
+    moves up to it, or to the time now, or to its earliest pending counter.
+*/
+inline void Tracer::retire(ThreadBuffer& buffer, int64_t floor)
+{
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        retiredRecords += buffer.records.size();
+        retiredStreams.push_back(std::move(buffer.records));
+        full = retiredRecords > retiredLimit;
+        if(memoryBudget) adapt_buffer(buffer);
+    }
+    buffer.records.clear();
+    buffer.records.reserve(buffer.limit.load(std::memory_order_relaxed));
+    buffer.generation++;
+    floor = std::min(floor, trace_timestamp());
+    for(const CounterState& state : buffer.counters)
+    {
+        if(state.pending) floor = std::min(floor, state.pendingTs);
+    }
+    buffer.oldest.store(floor);
+    if(!full) return;
+
+    std::lock_guard<std::mutex> lock(flushMutex);
+    std::vector<std::vector<TraceRecord>> streams;
+    int64_t watermark;
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        watermark = collect_streams(streams);
+    }
+    flush_streams(streams, watermark);
+}
+
+/*
+    void Tracer::end()
+
+    Stop tracing, wait for threads still inside a recording call, then flush every buffer and
+    close the traceFile. Also do closing details (closing bracket). Safe to call while other
+    threads record; tracing can be started again afterwards.
+*/
+inline void Tracer::end()
+{
+    std::lock_guard<std::mutex> session(sessionMutex);
+    if(!traceActive) return;
+    if(hitTimer.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(timerMutex);
+            timerStop = true;
+        }
+        timerWake.notify_all();
+        hitTimer.join();
+    }
+    traceActive = false;
+
+    //Wait until no other thread is inside a recording call; any call starting now sees traceActive false.
+    //The calling thread is in none, but may hold a reservation, which it cannot release while in here.
+    ThreadBuffer* own = &thread_buffer();
+    std::vector<std::vector<TraceRecord>> streams;
+    while(true)
+    {
+        std::unique_lock<std::mutex> lock(bufferMutex);
+        bool quiet = true;
+        for(ThreadBuffer* buffer : liveBuffers) quiet = quiet && (buffer == own || buffer->busy.load() == 0);
+        if(!quiet)
+        {
+            lock.unlock(); //A busy thread may be retiring its buffer
+            std::this_thread::yield();
+            continue;
+        }
+        streams.swap(retiredStreams);
+        retiredRecords = 0;
+        std::vector<TraceRecord> pending;
+        for(ThreadBuffer* buffer : liveBuffers)
+        {
+            if(buffer->epoch != traceEpoch.load()) continue;
+            pending_counters(*buffer, pending);
+            collect_elided(*buffer);
+            if(buffer->records.empty()) continue;
+            streams.push_back(std::move(buffer->records));
+            buffer->records.clear();
+        }
+        streams.push_back(std::vector<TraceRecord>());
+        signal_drain(streams.back());
+        if(signalDropped > 0)
+        {
+            std::cerr << "Warning: " << signalDropped << " records from signal handlers were dropped; give trace_signal_prepare more records.\n";
+        }
+        std::sort(pending.begin(), pending.end(), [](const TraceRecord& a, const TraceRecord& b){ return a.ts < b.ts; });
+        elided_summary(pending);
+        hit_summary(pending);
+        streams.push_back(std::move(pending));
+        traceEpoch++; //Leftover thread state now belongs to a finished session
+        break;
+    }
+
+    std::lock_guard<std::mutex> lock(flushMutex);
+    flush_streams(streams, INT64_MAX);
+    if(traceWriter.is_open())
+    {
+        write_index();
+        bool ok = outputFormat != TRACE_FORMAT_JSON || traceWriter.append("\n]", 2); //Closing Brace of JSON
+        if(!traceWriter.close() || !ok)
+        {
+            std::cerr << "Error: Unable to write trace output.\n";
+        }
+    }
+    if(markerFd >= 0) close(markerFd);
+    markerFd = -1;
+    remove_crash_handler();
+    formatPool.stop();
+}
+
+/*
+    void Tracer::write_index()
+
+    Appends the chunk index as two metadata events. "trace_index" lists every chunk written:
+    its file offset and length, the first and last timestamps in it, its number of events and
+    of metadata events, and [tid, offset] of the first event of each thread in it.
+    "trace_index_at", the last event in the file, gives the offset of "trace_index", so a
+    reader finds the index from the end of the file. In TRACE_FORMAT_JSONL each is one line.
+    Caller holds flushMutex.
+*/
+inline void Tracer::write_index()
+{
+    if(!indexed || chunks.empty()) return;
+    std::string text;
+    char buffer[160];
+    uint64_t indexAt = 0;
+    for(int part=0; part<2; part++)
+    {
+        uint64_t at = traceWriter.offset();
+        text.clear();
+        if(outputFormat == TRACE_FORMAT_JSON && !firstRecord) text += ",\n";
+        if(part == 0)
+        {
+            snprintf(buffer, sizeof(buffer), "{\"name\": \"trace_index\", \"ph\": \"M\", \"pid\": %i, \"tid\": 0, \"args\": { \"chunks\": [", PID_VALUE);
+            text += buffer;
+            for(size_t i=0; i<chunks.size(); i++)
+            {
+                const ChunkEntry& c = chunks[i];
+                //One chunk per line in a JSON array; JSONL keeps the whole event on its line
+                snprintf(buffer, sizeof(buffer), "%s%s{\"offset\": %" PRIu64 ", \"length\": %" PRIu64 ", ", i ? "," : "",
+                    outputFormat == TRACE_FORMAT_JSON ? "\n" : (i ? " " : ""), c.offset, c.length);
+                text += buffer;
+                if(c.first <= c.last) //Left out for a chunk of metadata only
+                {
+                    snprintf(buffer, sizeof(buffer), "\"first\": %" PRId64 ".%03u, \"last\": %" PRId64 ".%03u, ",
+                        c.first / 1000, unsigned(c.first % 1000), c.last / 1000, unsigned(c.last % 1000));
+                    text += buffer;
+                }
+                snprintf(buffer, sizeof(buffer), "\"events\": %zu, \"metadata\": %zu, \"threads\": [", c.records, c.metadata);
+                text += buffer;
+                for(size_t j=0; j<c.threads.size(); j++)
+                {
+                    snprintf(buffer, sizeof(buffer), "%s[%u, %" PRIu64 "]", j ? ", " : "", c.threads[j].first, c.threads[j].second);
+                    text += buffer;
+                }
+                text += "]}";
+            }
+            text += "]} }";
+            indexAt = at;
+        }
+        else
+        {
+            snprintf(buffer, sizeof(buffer), "{\"name\": \"trace_index_at\", \"ph\": \"M\", \"pid\": %i, \"tid\": 0, \"args\": { \"offset\": %" PRIu64 "} }", PID_VALUE, indexAt);
+            text += buffer;
+        }
+        if(outputFormat == TRACE_FORMAT_JSONL) text += '\n';
+        if(!traceWriter.append(text.data(), text.size()))
+        {
+            std::cerr << "Error: Unable to write the trace index.\n";
+            return;
+        }
+        if(traceWriter.offset() == at) return; //Dropped by a full shared-memory ring; no index then
+        firstRecord = false;
+    }
+}
+
+/*
+    const char* Tracer::intern(buffer, text)
+
+    Output is a copy of text that lives as long as the tracer, since records are formatted
+    long after the call that made them. Each thread remembers the copies of the strings it
+    passed: a string seen before costs one hash lookup and a compare, which also catches a
+    buffer reused for other text. Only new strings take internMutex. Returns text itself
+    for nullptr or with static strings on.
+*/
+inline const char* Tracer::intern(ThreadBuffer& buffer, const char* text)
+{
+    if(!text || staticStrings) return text;
+    auto found = buffer.interned.find(text);
+    if(found != buffer.interned.end() && strcmp(found->second, text) == 0) return found->second;
+    const char* copy;
+    {
+        std::lock_guard<std::mutex> lock(internMutex);
+        copy = internedStrings.insert(text).first->c_str();
+    }
+    buffer.interned[text] = copy;
+    return copy;
+}
+
+/*
+    TraceRecord& Tracer::record(buffer, phase, name, categories, tid, id, ts)
+
+    Pushes a record to the calling thread's buffer, retiring the buffer first if it is full.
+    Buffers grow on demand, so threads that record little stay small. A timestamp of 0 reads
+    the clock; a caller that read it earlier in the call passes its reading here, so that
+    retiring keeps the buffer's oldest at or before it. name and categories are interned.
+    Returns the record so callers can attach arguments.
+*/
+inline TraceRecord& Tracer::record(ThreadBuffer& buffer, char phase, const char* name, const char* categories, const unsigned int tid, uintptr_t id, int64_t ts)
+{
+    if( buffer.records.size() >= buffer.limit.load(std::memory_order_relaxed) ) retire(buffer, ts ? ts : INT64_MAX); //Retire if full
+
+    buffer.records.push_back(TraceRecord());
+    TraceRecord& record = buffer.records.back();
+    record.phase = phase;
+    record.value = COUNTER_NONE;
+    record.stack = 0;
+    record.name = intern(buffer, name);
+    record.categories = intern(buffer, categories);
+    record.tid = tid;
+    record.ts = ts ? ts : trace_timestamp();
+    record.id = id;
+    return record;
+}
+
+/*
+    bool Tracer::span_sampled(buffer) / span_end_sampled(buffer)
+
+    Sampling decisions for span starts and ends. A span left out makes everything nested in it
+    left out as well, so starts and ends always stay matched.
+*/
+inline bool Tracer::span_sampled(ThreadBuffer& buffer)
+{
+    if(buffer.skipDepth > 0 || (buffer.depth == 0 && sampleRate > 1 && buffer.topSpans++ % sampleRate != 0))
+    {
+        buffer.skipDepth++;
+        return false;
+    }
+    buffer.depth++;
+    return true;
+}
+
+inline bool Tracer::span_end_sampled(ThreadBuffer& buffer)
+{
+    if(buffer.skipDepth > 0)
+    {
+        buffer.skipDepth--;
+        return false;
+    }
+    if(buffer.depth > 0) buffer.depth--;
+    return true;
+}
+
+/*
+    void Tracer::span_opened(buffer)
+
+    Called after a span start is recorded: when minimum durations or scheduler stats are on,
+    pushes the span on the thread's stack of open spans together with the filter for its name
+    and the scheduler counters at its start.
+*/
+inline void Tracer::span_opened(ThreadBuffer& buffer)
+{
+    if(minDurations.empty() && !schedStats) return;
+    const char* name = buffer.records.back().name;
+    if(minDurations.empty()) buffer.lastFilter = -1;
+    else if(name != buffer.lastFilterName)
+    {
+        buffer.lastFilter = -1;
+        for(size_t i=0; i<minDurations.size(); i++)
+        {
+            if(minDurations[i].name == name) buffer.lastFilter = int(i);
+        }
+        buffer.lastFilterName = name;
+    }
+    OpenSpan span;
+    span.index = buffer.records.size() - 1;
+    span.generation = buffer.generation;
+    span.filter = buffer.lastFilter;
+    span.ts = buffer.records.back().ts;
+    if(schedStats) trace_sched_sample(buffer.schedFd, span.cpu, span.wait);
+    buffer.spans.push_back(span);
+}
+
+/*
+    bool Tracer::span_closed(buffer, span)
+
+    Pops the innermost open span into span as it ends. Output is false if spans are not
+    being tracked.
+*/
+inline bool Tracer::span_closed(ThreadBuffer& buffer, OpenSpan& span)
+{
+    if(buffer.spans.empty()) return false;
+    span = buffer.spans.back();
+    buffer.spans.pop_back();
+    return true;
+}
+
+/*
+    bool Tracer::span_elided(buffer, span, now)
+
+    Called as a span ends at now. If the span is shorter than the minimum duration for its
+    name and its start is still the last record in the buffer, retracts the start, counts the
+    span as elided and returns true: nothing is written for it. Otherwise the end is recorded.
+*/
+inline bool Tracer::span_elided(ThreadBuffer& buffer, const OpenSpan& span, int64_t now)
+{
+    if(span.filter < 0 || now - span.ts >= minDurations[span.filter].threshold) return false;
+    if(span.generation != buffer.generation || span.index + 1 != buffer.records.size()) return false; //Written already, or has records inside
+    buffer.records.pop_back();
+    if(buffer.elided.size() <= size_t(span.filter)) buffer.elided.resize(minDurations.size());
+    buffer.elided[span.filter].count++;
+    buffer.elided[span.filter].total += now - span.ts;
+    return true;
+}
+
+/*
+    void Tracer::sched_args(buffer, span, now, args)
+
+    With scheduler stats on, appends the on-CPU, runqueue wait and off-CPU parts of a span
+    ending at now to the end record's args.
+*/
+inline void Tracer::sched_args(ThreadBuffer& buffer, const OpenSpan& span, int64_t now, std::string& args)
+{
+    if(!schedStats) return;
+    int64_t cpu, wait;
+    trace_sched_sample(buffer.schedFd, cpu, wait);
+    double duration = (now - span.ts) / 1000.0;
+    double running = (cpu - span.cpu) / 1000.0;
+    char text[128];
+    if(wait >= 0 && span.wait >= 0)
+    {
+        double waiting = (wait - span.wait) / 1000.0;
+        snprintf(text, sizeof(text), "\"on_cpu_us\": %.3f, \"runq_wait_us\": %.3f, \"off_cpu_us\": %.3f",
+            running, waiting, std::max(0.0, duration - running - waiting));
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "\"on_cpu_us\": %.3f, \"off_cpu_us\": %.3f", running, std::max(0.0, duration - running));
+    }
+    if(!args.empty()) args += ", ";
+    args += text;
+}
+
+/*
+    void Tracer::context_opened(buffer, tid)
+
+    Called after a span start is recorded, once contexts are in use on the thread. Drops the
+    ids left from spans that ended at this depth. If a context was restored, the span adopts
+    it: its start gets the trace, its own span id and the parent's, and the flow from the
+    parent ends in it.
+*/
+inline void Tracer::context_opened(ThreadBuffer& buffer, const unsigned int tid)
+{
+    if(buffer.spanIds.size() >= buffer.depth) buffer.spanIds.resize(buffer.depth - 1);
+    if(!buffer.adopted.flow) return;
+    SpanContext parent = buffer.adopted;
+    buffer.adopted = SpanContext();
+    SpanIds ids;
+    ids.span = nextContextId++;
+    ids.trace = parent.trace;
+    buffer.spanIds.resize(buffer.depth - 1, SpanIds{0, 0});
+    buffer.spanIds.push_back(ids);
+
+    TraceRecord& start = buffer.records.back();
+    char args[128];
+    snprintf(args, sizeof(args), "%s\"trace_id\": %" PRIu64 ", \"span_id\": %" PRIu64 ", \"parent_id\": %" PRIu64,
+        start.args.empty() ? "" : ", ", ids.trace, ids.span, parent.span);
+    start.args += args;
+    int64_t ts = start.ts;
+    record(buffer, 'f', "context", "flow", tid, uintptr_t(parent.flow), ts);
+}
+
+/*
+    SpanContext Tracer::context_capture()
+
+    The context of the innermost open span on this thread, to hand to the thread that runs
+    work it started. Gives the span and the root of its trace ids, if they had none, and
+    records the start of a flow bound to the span. With no span open, passes on a context
+    restored on this thread and not yet adopted; otherwise returns an empty context.
+*/
+inline SpanContext Tracer::context_capture(const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return SpanContext(); //Do nothing if trace_start not called
+
+    ThreadBuffer& buffer = recording.buffer;
+    if(buffer.depth == 0) return buffer.adopted;
+    buffer.spanIds.resize(buffer.depth, SpanIds{0, 0}); //Also drops spans that ended
+    SpanIds& ids = buffer.spanIds.back();
+    if(ids.span == 0) ids.span = nextContextId++;
+    if(ids.trace == 0) //Inherited from the nearest span that knows it, or the root's span id
+    {
+        size_t known = buffer.spanIds.size() - 1;
+        while(known > 0 && buffer.spanIds[known].trace == 0) known--;
+        SpanIds& root = buffer.spanIds[known];
+        if(root.trace == 0)
+        {
+            if(root.span == 0) root.span = nextContextId++;
+            root.trace = root.span;
+        }
+        for(size_t i=known; i<buffer.spanIds.size(); i++) buffer.spanIds[i].trace = root.trace;
+    }
+
+    SpanContext context;
+    context.trace = ids.trace;
+    context.span = ids.span;
+    context.flow = nextContextId++;
+    char args[96];
+    snprintf(args, sizeof(args), "\"trace_id\": %" PRIu64 ", \"span_id\": %" PRIu64, context.trace, context.span);
+    record(buffer, 's', "context", "flow", tid, uintptr_t(context.flow)).args = args;
+    return context;
+}
+
+/*
+    SpanContext Tracer::context_restore(context)
+
+    Makes context the parent of the next span started on this thread. Output is the context
+    it replaces, to put back when the work is done (see TraceContextScope).
+*/
+inline SpanContext Tracer::context_restore(const SpanContext& context)
+{
+    Recording recording(*this);
+    if(!recording.active) return SpanContext(); //Do nothing if trace_start not called
+
+    SpanContext previous = recording.buffer.adopted;
+    recording.buffer.adopted = context;
+    return previous;
+}
+
+/*
+    void Tracer::capture_stack(buffer, record)
+
+    If stacks are captured for the record's name, walks the call stack into the thread's frame
+    buffer and sets the record's stack index. A stack the thread has seen before costs one hash
+    lookup; only new stacks take stackMutex to be added to the table.
+*/
+inline void Tracer::capture_stack(ThreadBuffer& buffer, TraceRecord& record)
+{
+    if(stackNames.empty()) return;
+    if(record.name != buffer.lastStackName)
+    {
+        buffer.lastStackCapture = std::find(stackNames.begin(), stackNames.end(), record.name) != stackNames.end();
+        buffer.lastStackName = record.name;
+    }
+    if(!buffer.lastStackCapture) return;
+    if(buffer.stackTop == 0) buffer.stackTop = trace_stack_top();
+
+    size_t count = trace_capture_stack(buffer.frames, STACK_DEPTH, buffer.stackTop);
+    uint64_t hash = 14695981039346656037ull; //FNV-1a over the addresses
+    for(size_t i=0; i<count; i++) hash = (hash ^ buffer.frames[i]) * 1099511628211ull;
+    auto known = buffer.stackIds.find(hash);
+    if(known != buffer.stackIds.end())
+    {
+        record.stack = known->second;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(stackMutex);
+    auto& index = stackIndex[hash];
+    if(index == 0)
+    {
+        stackFrames.push_back(std::vector<uintptr_t>(buffer.frames, buffer.frames + count));
+        index = uint32_t(stackFrames.size());
+    }
+    buffer.stackIds[hash] = index;
+    record.stack = index;
+}
+
+/*
+    void Tracer::render_stacks()
+
+    Symbolizes the stacks captured since the last write into stackText, leaving out the frames
+    inside tracelib itself. Runs on the flushing thread, holding flushMutex, before records
+    are formatted.
+*/
+inline void Tracer::render_stacks()
+{
+    std::vector<std::vector<uintptr_t>> added;
+    {
+        std::lock_guard<std::mutex> lock(stackMutex);
+        if(stackText.size() == stackFrames.size()) return;
+        added.assign(stackFrames.begin() + stackText.size(), stackFrames.end());
+    }
+    for(auto const& frames : added)
+    {
+        std::string text = "[";
+        bool inside = true; //Still in tracelib's own frames
+        for(uintptr_t address : frames)
+        {
+            std::string name = trace_symbolize(address);
+            if(inside && name.compare(0, 7, "trace::") == 0) continue; //Not "trace_", which a module name can start with
+            inside = false;
+            if(text.size() > 1) text += ", ";
+            text += '"';
+            for(char c : name)
+            {
+                if(c == '"' || c == '\\') text += '\\';
+                text += c;
+            }
+            text += '"';
+        }
+        text += ']';
+        stackText.push_back(text);
+    }
+}
+
+/*
+    void Tracer::collect_elided(buffer) / elided_summary(out)
+
+    collect_elided adds a thread's elided span counts to the tracer's totals; bufferMutex must
+    be held. elided_summary appends the totals to out as one counter record per filter and
+    clears them.
+*/
+inline void Tracer::collect_elided(ThreadBuffer& buffer)
+{
+    if(buffer.elided.empty()) return;
+    if(elidedTotals.size() < buffer.elided.size()) elidedTotals.resize(buffer.elided.size());
+    for(size_t i=0; i<buffer.elided.size(); i++)
+    {
+        elidedTotals[i].count += buffer.elided[i].count;
+        elidedTotals[i].total += buffer.elided[i].total;
+    }
+    buffer.elided.clear();
+}
+
+/*
+    void Tracer::hit_summary(out)
+
+    Appends a counter record to out for every counted name hit since the last one was
+    written, with its hits since the session started. Caller holds bufferMutex.
+*/
+inline void Tracer::hit_summary(std::vector<TraceRecord>& out)
+{
+    std::vector<uint64_t> totals;
+    trace_hit_totals(totals);
+    hitBase.resize(totals.size(), 0); //Names counted since the session started
+    hitWritten.resize(totals.size(), 0);
+    int64_t now = trace_timestamp();
+    for(size_t i=0; i<totals.size(); i++)
+    {
+        uint64_t hits = totals[i] - hitBase[i];
+        if(hits == hitWritten[i]) continue;
+        out.push_back(TraceRecord());
+        TraceRecord& r = out.back();
+        r.phase = 'C';
+        r.value = COUNTER_INT;
+        r.name = hitNames[i];
+        r.categories = nullptr;
+        r.tid = TID_VALUE;
+        r.stack = 0;
+        r.ts = now;
+        r.id = uintptr_t(hits);
+        hitWritten[i] = hits;
+    }
+}
+
+inline void Tracer::elided_summary(std::vector<TraceRecord>& out)
+{
+    int64_t now = trace_timestamp();
+    for(size_t i=0; i<elidedTotals.size() && i<minDurations.size(); i++)
+    {
+        if(elidedTotals[i].count == 0) continue;
+        out.push_back(TraceRecord());
+        TraceRecord& r = out.back();
+        r.phase = 'C';
+        r.value = COUNTER_NONE;
+        r.name = minDurations[i].summary.c_str();
+        r.categories = nullptr;
+        r.tid = TID_VALUE;
+        r.ts = now;
+        r.id = 0;
+        char buffer[96];
+        snprintf(buffer, sizeof(buffer), "\"count\": %" PRIu64 ", \"total_us\": %.3f",
+            elidedTotals[i].count, elidedTotals[i].total / 1000.0);
+        r.args = buffer;
+    }
+    elidedTotals.clear();
+}
+
+/*
+    void Tracer::process_name()
+
+    Pushes the process_name metadata record (i.e. "ph" = "M") that labels this pid.
+*/
+inline void Tracer::process_name()
+{
+    Recording recording(*this);
+    if(!recording.active) return;
+
+    std::string name = processName;
+    if(name.empty())
+    {
+        char comm[64] = {0};
+        FILE* file = fopen("/proc/self/comm", "r");
+        if(file)
+        {
+            if(fgets(comm, sizeof(comm), file)) comm[strcspn(comm, "\n")] = 0;
+            fclose(file);
+        }
+        name = comm[0] ? comm : "process";
+    }
+    record(recording.buffer, 'M', "process_name", nullptr, TID_VALUE).args = "\"name\": \"" + name + "\"";
+}
+
+/*
+    void Tracer::calibrate()
+
+    Measures what tracing itself adds to the durations it records by timing CALIBRATION_SPANS
+    empty spans on the calling thread, after as many more that warm up the buffer and the
+    code path, then drops their records. spanOverhead is the median duration of an empty
+    span, the cost every span adds to its own duration; eventOverhead is the cost of one
+    recording call, half the median time from one span start to the next, which every record
+    inside a span adds to the span. Both come from the same spans, and are written as the
+    "tracelib_overhead" metadata record, which trace_analyze --compensate subtracts.
+
+    The measurement runs once per process: later sessions, of this or any other Tracer, reuse
+    the cached overheads and only write the metadata record.
+*/
+inline void Tracer::calibrate()
+{
+    {
+        std::lock_guard<std::mutex> lock(calibrationMutex);
+        spanOverhead = calibratedSpan;
+        eventOverhead = calibratedEvent;
+    }
+    if(spanOverhead < 0) measure_overhead();
+    if(spanOverhead < 0) //Buffers too small, or the session ended
+    {
+        spanOverhead = eventOverhead = 0;
+        return;
+    }
+
+    Recording recording(*this);
+    if(!recording.active) return;
+    char args[96];
+    snprintf(args, sizeof(args), "\"span_ns\": %" PRId64 ", \"event_ns\": %" PRId64, spanOverhead, eventOverhead);
+    record(recording.buffer, 'M', "tracelib_overhead", nullptr, TID_VALUE).args = args;
+}
+
+/*
+    void Tracer::measure_overhead()
+
+    Times the calibration spans for calibrate(), setting spanOverhead and eventOverhead and
+    caching them for the rest of the process, or leaving spanOverhead at -1 if it cannot.
+*/
+inline void Tracer::measure_overhead()
+{
+    std::vector<int64_t> spans, periods;
+    spans.reserve(CALIBRATION_SPANS);
+    periods.reserve(CALIBRATION_SPANS);
+    size_t timed = 0; //Spans recorded so far, the first CALIBRATION_SPANS only warming up
+    while(spans.size() < size_t(CALIBRATION_SPANS))
+    {
+        Recording recording(*this);
+        if(!recording.active) return;
+        ThreadBuffer& buffer = recording.buffer;
+        size_t mark = buffer.records.size();
+        size_t limit = buffer.limit.load(std::memory_order_relaxed);
+        if(mark + 2 > limit)
+        {
+            retire(buffer);
+            mark = 0;
+            limit = buffer.limit.load(std::memory_order_relaxed);
+        }
+        size_t batch = std::min<size_t>(limit > mark ? (limit - mark) / 2 : 0, 2 * CALIBRATION_SPANS - timed);
+        if(batch == 0) return; //Buffers too small to hold a span
+        reserve_records(buffer, 2 * batch); //Kept through the timed spans, as records are dropped
+        for(size_t i=0; i<batch; i++)
+        {
+            { Recording inner(*this); record(inner.buffer, 'B', "calibration", "tracelib", TID_VALUE); }
+            { Recording inner(*this); record(inner.buffer, 'E', nullptr, nullptr, TID_VALUE); }
+        }
+        for(size_t i=mark; i+1<buffer.records.size(); i+=2, timed++)
+        {
+            if(timed < size_t(CALIBRATION_SPANS)) continue;
+            spans.push_back(buffer.records[i+1].ts - buffer.records[i].ts);
+            if(i+2 < buffer.records.size()) periods.push_back(buffer.records[i+2].ts - buffer.records[i].ts);
+        }
+        buffer.records.resize(mark);
+    }
+    std::nth_element(spans.begin(), spans.begin() + spans.size() / 2, spans.end());
+    spanOverhead = spans[spans.size() / 2];
+    if(!periods.empty())
+    {
+        std::nth_element(periods.begin(), periods.begin() + periods.size() / 2, periods.end());
+        eventOverhead = periods[periods.size() / 2] / 2;
+    }
+    else eventOverhead = spanOverhead; //One span per batch, in tiny buffers
+
+    std::lock_guard<std::mutex> lock(calibrationMutex);
+    if(calibratedSpan < 0)
+    {
+        calibratedSpan = spanOverhead;
+        calibratedEvent = eventOverhead;
+    }
+}
+
+/*
+    void Tracer::event_start(name, categories)
+
+    Pushes a line to the buffer to start an event (i.e. "ph" = "B"). Inputs are self explanatory
+*/
+inline void Tracer::event_start(const char* name, const char* categories, const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return; //Do nothing if trace_start not called
+
+    if(!span_sampled(recording.buffer)) return;
+    capture_stack(recording.buffer, record(recording.buffer, 'B', name, categories, tid));
+    if(markerFd >= 0) kernel_marker('B', name);
+    span_opened(recording.buffer);
+    if(!recording.buffer.spanIds.empty() || recording.buffer.adopted.flow) context_opened(recording.buffer, tid);
+}
+
+/*
+    void Tracer::event_start(name, categories, argumentNames, argumentValues)
+
+    Same as above, but takes arguments
+*/
+inline void Tracer::event_start(const char* name, const char* categories, std::initializer_list<const char*> argumentNames, std::initializer_list<const char*> argumentValues, const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return; //Do nothing if trace_start not called
+
+    if(argumentNames.size() != argumentValues.size()) //Lists have different sizes
+    {
+        std::cerr << "Error: Argument lists for " << name << " in trace_event_start are not the same size; ignoring them.\n";
+        event_start(name, categories, tid);
+    }
+    else if(span_sampled(recording.buffer))
+    {
+        TraceRecord& r = record(recording.buffer, 'B', name, categories, tid);
+        trace_format_args(r.args, argumentNames, argumentValues);
+        capture_stack(recording.buffer, r);
+        if(markerFd >= 0) kernel_marker('B', name);
+        span_opened(recording.buffer);
+        if(!recording.buffer.spanIds.empty() || recording.buffer.adopted.flow) context_opened(recording.buffer, tid);
+    }
+}
+
+/*
+    void Tracer::event_end()
+
+    Pushes a line to the buffer to end an event (i.e. "ph" = "E").
+*/
+inline void Tracer::event_end(const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return; //Do nothing if trace_start not called
+
+    if(!span_end_sampled(recording.buffer)) return;
+    int64_t now = trace_timestamp();
+    if(markerFd >= 0) kernel_marker('E', nullptr); //Also for elided spans, whose start went out
+    OpenSpan span;
+    bool tracked = span_closed(recording.buffer, span);
+    if(tracked && span_elided(recording.buffer, span, now)) return;
+    TraceRecord& r = record(recording.buffer, 'E', nullptr, nullptr, tid, 0, now);
+    if(tracked) sched_args(recording.buffer, span, now, r.args);
+}
+
+/*
+    void Tracer::event_end(argumentNames, argumentValues)
+
+    Same as above, but takes arguments
+*/
+inline void Tracer::event_end(std::initializer_list<const char*> argumentNames, std::initializer_list<const char*> argumentValues, const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return; //Do nothing if trace_start not called
+
+    if(argumentNames.size() != argumentValues.size()) //Lists have different sizes
+    {
+        std::cerr << "Error: Argument lists in trace_event_end are not the same size; ignoring them.\n";
+        event_end(tid);
+    }
+    else if(span_end_sampled(recording.buffer))
+    {
+        int64_t now = trace_timestamp();
+        if(markerFd >= 0) kernel_marker('E', nullptr);
+        OpenSpan span;
+        bool tracked = span_closed(recording.buffer, span);
+        if(tracked && span_elided(recording.buffer, span, now)) return;
+        TraceRecord& r = record(recording.buffer, 'E', nullptr, nullptr, tid, 0, now);
+        trace_format_args(r.args, argumentNames, argumentValues);
+        if(tracked) sched_args(recording.buffer, span, now, r.args);
+    }
+}
+
+/*
+    void Tracer::object_new(name, obj_pointer)
+
+    Pushes a line to the buffer to create an object (i.e. "ph" = "N")
+*/
+inline void Tracer::object_new(const char* name, const void* obj_pointer, const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return; //Do nothing if trace_start not called
+
+    capture_stack(recording.buffer, record(recording.buffer, 'N', name, nullptr, tid, (uintptr_t)obj_pointer));
+}
+
+/*
+    void Tracer::object_gone(name, obj_pointer)
+
+    Pushes a line to the buffer to destroy an object (i.e. "ph" = "D")
+*/
+inline void Tracer::object_gone(const char* name, const void* obj_pointer, const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return; //Do nothing if trace_start not called
+
+    record(recording.buffer, 'D', name, nullptr, tid, (uintptr_t)obj_pointer);
+}
+
+/*
+    void Tracer::instant_global(name, scope='t')
+
+    Pushes a line to the buffer to create a global instant
+*/
+inline void Tracer::instant_global(const char* name, const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return; //Do nothing if trace_start not called
+
+    capture_stack(recording.buffer, record(recording.buffer, 'i', name, nullptr, tid));
+}
+
+/*
+    void Tracer::counter(name, key, value)
+
+    Pushes a line to the buffer to create a counter event
+    key contains the names, value contains the respective values
+*/
+inline void Tracer::counter(const char* name, std::initializer_list<const char*> key, std::initializer_list<const char*> value, const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return; //Do nothing if trace_start not called
+
+    if(key.size() != value.size()) //Lists have different sizes
+    {
+        std::cerr << "Error: Argument lists for " << name << " in trace_counter are not the same size; ignoring this event.\n";
+        //return
+    }
+    else
+    {
+        trace_format_args(record(recording.buffer, 'C', name, nullptr, tid).args, key, value);
+    }
+}
+
+/*
+    void Tracer::counter_int(name, value) / counter_double(name, value)
+
+    Sets a numeric counter, shown by the viewer as a graph with one "value" series. Unlike
+    counter(), these are cheap enough for hot loops: each thread keeps the last value of each
+    counter and records nothing if it is unchanged, and at most one record per counter interval
+    (see set_counter_interval); the latest value held back by the interval is recorded at the
+    next flush. Counters are told apart by name, so use the same name for the same counter.
+*/
+inline void Tracer::counter_int(const char* name, int64_t value, const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return; //Do nothing if trace_start not called
+
+    counter_sample(recording.buffer, name, COUNTER_INT, uint64_t(value), tid);
+}
+
+inline void Tracer::counter_double(const char* name, double value, const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return; //Do nothing if trace_start not called
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    counter_sample(recording.buffer, name, COUNTER_DOUBLE, bits, tid);
+}
+
+/*
+    void Tracer::reserve_records(buffer, count)
+
+    Makes room for count more records in the buffer, growing it geometrically so repeated
+    reservations do not copy it each time.
+*/
+inline void Tracer::reserve_records(ThreadBuffer& buffer, size_t count)
+{
+    size_t needed = buffer.records.size() + count;
+    if(buffer.records.capacity() < needed) buffer.records.reserve(std::max(needed, 2 * buffer.records.capacity()));
+}
+
+/*
+    TraceReservation Tracer::reserve(count)
+
+    Claims count records in the calling thread's buffer at once, retiring it first if they
+    do not fit, for a loop to fill through the reservation. Events recorded through it skip
+    sampling, minimum durations, stack capture, span contexts and kernel markers, so its
+    span starts and ends should pair up among themselves.
+*/
+inline TraceReservation Tracer::reserve(size_t count, const unsigned int tid)
+{
+    Recording recording(*this);
+    if(!recording.active) return TraceReservation(); //Do nothing if trace_start not called
+
+    ThreadBuffer& buffer = recording.buffer;
+    if(buffer.records.size() + count > buffer.limit.load(std::memory_order_relaxed) && !buffer.records.empty()) retire(buffer);
+    reserve_records(buffer, count);
+    return TraceReservation(buffer, *this, tid, count);
+}
+
+/*
+    bool TraceReservation::fill(phase, name, categories, ts)
+
+    Fills the next reserved slot, interning name and categories as Tracer::record does.
+*/
+inline bool TraceReservation::fill(char phase, const char* name, const char* categories, int64_t ts)
+{
+    if(left == 0 || tracer->traceEpoch.load(std::memory_order_relaxed) != epoch) return false;
+    left--;
+    buffer->records.push_back(TraceRecord());
+    TraceRecord& record = buffer->records.back();
+    record.phase = phase;
+    record.value = COUNTER_NONE;
+    record.stack = 0;
+    record.name = tracer->intern(*buffer, name);
+    record.categories = tracer->intern(*buffer, categories);
+    record.tid = tid;
+    record.ts = ts ? ts : trace_timestamp();
+    record.id = 0;
+    return true;
+}
+
+/*
+    void Tracer::record_batch(events, count)
+
+    Records events timestamped by the caller with one recording call, as reserve() does.
+    The records of a thread are written in the order recorded, so the events should be in
+    time order and no earlier than what the thread recorded before them. Events from before
+    the call can be written after later events of other threads if a flush runs meanwhile.
+*/
+inline void Tracer::record_batch(const BatchEvent* events, size_t count)
+{
+    Recording recording(*this);
+    if(!recording.active) return; //Do nothing if trace_start not called
+
+    ThreadBuffer& buffer = recording.buffer;
+    while(count > 0)
+    {
+        if(buffer.records.size() >= buffer.limit.load(std::memory_order_relaxed)) retire(buffer, events->ts); //Once per buffer instead of per event
+        size_t room = std::min(count, buffer.limit.load(std::memory_order_relaxed) - buffer.records.size());
+        reserve_records(buffer, room);
+        for(size_t i=0; i<room; i++)
+        {
+            const BatchEvent& event = events[i];
+            if(event.phase != 'B' && event.phase != 'E' && event.phase != 'i') continue;
+            buffer.records.push_back(TraceRecord());
+            TraceRecord& record = buffer.records.back();
+            record.phase = event.phase;
+            record.value = COUNTER_NONE;
+            record.stack = 0;
+            record.name = event.phase == 'E' ? nullptr : intern(buffer, event.name);
+            record.categories = event.phase == 'B' ? intern(buffer, event.categories) : nullptr;
+            record.tid = event.tid;
+            record.ts = event.ts;
+            record.id = 0;
+        }
+        events += room;
+        count -= room;
+    }
+}
+
+/*
+    void Tracer::set_counter_interval(microseconds)
+
+    Least time between two records of the same numeric counter on one thread; 0 (the default)
+    records every change. Takes effect at the next start().
+*/
+inline void Tracer::set_counter_interval(unsigned int microseconds)
+{
+    counterInterval = int64_t(microseconds) * 1000;
+}
+
+/*
+    void Tracer::set_min_duration(name, nanoseconds)
+
+    Drops spans called name that end within nanoseconds of their start, as long as nothing
+    was recorded inside them; 0 removes the filter. trace_end writes their number and total
+    duration as a counter called "<name> (elided)" instead. Takes effect at the next start().
+*/
+inline void Tracer::set_min_duration(const char* name, unsigned int nanoseconds)
+{
+    for(size_t i=0; i<minDurations.size(); i++)
+    {
+        if(minDurations[i].name == name)
+        {
+            if(nanoseconds > 0) minDurations[i].threshold = nanoseconds;
+            else minDurations.erase(minDurations.begin() + i);
+            return;
+        }
+    }
+    if(nanoseconds > 0) minDurations.push_back(MinDuration{name, nanoseconds, std::string(name) + " (elided)"});
+}
+
+/*
+    void Tracer::set_stack_capture(name, enabled)
+
+    Captures the call stack of every span start, object creation and instant called name, shown
+    as a "stack" argument. Stacks are walked through frame pointers, so build with
+    -fno-omit-frame-pointer, and -rdynamic for function names. Takes effect at the next start().
+*/
+inline void Tracer::set_stack_capture(const char* name, bool enabled)
+{
+    auto found = std::find(stackNames.begin(), stackNames.end(), name);
+    if(enabled && found == stackNames.end()) stackNames.push_back(name);
+    if(!enabled && found != stackNames.end()) stackNames.erase(found);
+}
+
+/*
+    void Tracer::set_sched_stats(enabled)
+
+    Adds "on_cpu_us", "runq_wait_us" and "off_cpu_us" to the end of every span: how much of it
+    the thread spent running, waiting in the runqueue for a CPU, and blocked or sleeping. Costs
+    two system calls at each span start and end. Without schedstat (kernels built without
+    CONFIG_SCHEDSTATS) only on-CPU time and the rest as off-CPU are given. Takes effect at the
+    next start().
+*/
+inline void Tracer::set_sched_stats(bool enabled)
+{
+    schedStats = enabled;
+}
+
+/*
+    void Tracer::set_kernel_markers(enabled)
+
+    Also writes every span start and end to ftrace's trace_marker as it is recorded, as
+    "B|pid|name" and "E|pid" (the format systrace and Perfetto read), so the spans show up in
+    the kernel trace next to sched_switch and sched_wakeup. trace_sched merges such a kernel
+    trace back into the tracelib trace. Costs a system call at each span start and end, and
+    needs write access to tracefs. Takes effect at the next start().
 */
-#ifndef TRACELIB_H_INCLUDED
-#define TRACELIB_H_INCLUDED
+inline void Tracer::set_kernel_markers(bool enabled)
+{
+    kernelMarkers = enabled;
+}
 
-#include <vector>
-#include <cstring>
-#include <fstream>
-#include <iostream>
-#include <chrono>
+/*
+    void Tracer::set_hit_interval(milliseconds)
 
-#define __STDC_FORMAT_MACROS
-#include <inttypes.h>
+    Flushes every milliseconds from a thread of its own while tracing, so the counts of
+    TRACE_COUNT sites are written over time and not only at each flush(); 0 (the default)
+    leaves flushing to the program. Takes effect at the next start().
+*/
+inline void Tracer::set_hit_interval(unsigned int milliseconds)
+{
+    hitInterval = milliseconds;
+}
 
-namespace trace
+/*
+    void Tracer::set_static_strings(enabled)
+
+    Promises that every name and category string passed in stays valid until the trace is
+    ended, as string literals do, so records keep the callers' pointers instead of copies
+    (see intern). Off by default.
+*/
+inline void Tracer::set_static_strings(bool enabled)
 {
-using Clock=std::chrono::high_resolution_clock;
+    staticStrings = enabled;
+}
 
-//Constants and Statics
-const int TRACE_MAX = 10000;
-static bool traceActive = false;
-static std::vector<std::string> dataVector;
-static int PID_VALUE = 1; //For now, always 1
-static int TID_VALUE = 1; //For now, always 1
-static std::ofstream traceFile;
-static char stringBuffer[1000];
-static bool clockInit = false;
-static std::chrono::high_resolution_clock::time_point startTime;
+/*
+    void Tracer::open_kernel_markers()
+
+    Opens trace_marker for the session, from tracefs or its older place under debugfs, and
+    warns if the kernel trace is not on the clock tracelib uses. Caller holds flushMutex.
+*/
+inline void Tracer::open_kernel_markers()
+{
+    const char* const directories[] = { "/sys/kernel/tracing", "/sys/kernel/debug/tracing" };
+    for(const char* directory : directories)
+    {
+        markerFd = open((std::string(directory) + "/trace_marker").c_str(), O_WRONLY | O_CLOEXEC);
+        if(markerFd < 0) continue;
+        char clock[256] = "";
+        int fd = open((std::string(directory) + "/trace_clock").c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd >= 0)
+        {
+            ssize_t length = read(fd, clock, sizeof(clock) - 1);
+            clock[length > 0 ? length : 0] = 0;
+            close(fd);
+        }
+        if(!strstr(clock, "[mono]"))
+        {
+            std::cerr << "Warning: The kernel trace clock is not mono, so its timestamps will not line up with the trace; run \"echo mono > " << directory << "/trace_clock\".\n";
+        }
+        return;
+    }
+    std::cerr << "Error: Unable to open trace_marker (" << strerror(errno) << "); spans are not mirrored into the kernel trace.\n";
+}
 
 /*
-    bool trace_start(filename)
+    void Tracer::kernel_marker(phase, name)
 
-    Starts the trace procedure. This includes opening the file (only written to on closing
-    or exceeding the memory however), and allocating a vector to contain the data.
+    Writes one span start ('B', with its name) or end ('E') to trace_marker.
+*/
+inline void Tracer::kernel_marker(char phase, const char* name)
+{
+    char text[256];
+    int length = name ? snprintf(text, sizeof(text), "%c|%i|%s", phase, PID_VALUE, name) : snprintf(text, sizeof(text), "%c|%i", phase, PID_VALUE);
+    if(length >= int(sizeof(text))) length = sizeof(text) - 1; //Truncated by a very long name
+    ssize_t written = write(markerFd, text, length);
+    (void)written; //A marker lost when the kernel buffer is full is not worth stopping for
+}
 
-    Output is true if successful, false otherwise.
+/*
+    void Tracer::counter_sample(buffer, name, value, bits, tid)
+
+    Records a numeric counter value unless it is unchanged or the interval since its last
+    record has not passed yet, in which case it is kept as the pending value.
 */
-inline bool trace_start(const char* filename)
+inline void Tracer::counter_sample(ThreadBuffer& buffer, const char* name, char value, uint64_t bits, const unsigned int tid)
 {
-    traceFile.open(filename);
-    if(traceFile.is_open())
+    name = intern(buffer, name);
+    std::vector<CounterState>& counters = buffer.counters;
+    size_t i = buffer.lastCounter;
+    if(i >= counters.size() || counters[i].name != name)
     {
-        dataVector.reserve(TRACE_MAX);
-        traceFile << "[\n"; //Opening brace of JSON
+        for(i=0; i<counters.size() && counters[i].name != name; i++);
+        if(i == counters.size()) //Another copy of the same literal, or a new counter
+        {
+            for(i=0; i<counters.size() && strcmp(counters[i].name, name) != 0; i++);
+        }
+        if(i == counters.size())
+        {
+            CounterState state = CounterState();
+            state.name = name;
+            state.ts = INT64_MIN;
+            counters.push_back(state);
+        }
+        buffer.lastCounter = i;
     }
-    else
+    CounterState& state = counters[i];
+
+    if(state.ts != INT64_MIN && state.value == value && state.bits == bits)
     {
-        std::cerr << "Error: Unable to open file \"" << filename << "\" for trace output.\n";
-        return 0;
+        state.pending = false; //Back to the value last recorded
+        return;
     }
-    //Clock should only be initialized once for all threads
-    if(!clockInit)
+    int64_t now = trace_timestamp();
+    if(state.ts != INT64_MIN && now - state.ts < counterInterval)
     {
-        startTime = Clock::now();
-        clockInit = true;
+        state.pending = true;
+        state.pendingValue = value;
+        state.pendingBits = bits;
+        state.pendingTs = now;
+        state.tid = tid;
+        return;
     }
-    traceActive = true;
-    return 1;
+    TraceRecord& r = record(buffer, 'C', name, nullptr, tid, uintptr_t(bits), now);
+    r.value = value;
+    state.value = value;
+    state.bits = bits;
+    state.ts = now;
+    state.pending = false;
 }
 
 /*
-    void trace_flush()
+    void Tracer::pending_counters(buffer, out)
 
-    Flush the dataVector; that is, dump it to the file, and empty the array.
+    Appends a record for every pending numeric counter value in the buffer to out, in time
+    order, stamped with the time the value was set.
 */
-inline void trace_flush()
+inline void Tracer::pending_counters(ThreadBuffer& buffer, std::vector<TraceRecord>& out)
 {
-    for(auto const& value : dataVector)
+    size_t first = out.size();
+    for(CounterState& state : buffer.counters)
     {
-        traceFile << value;
+        if(!state.pending) continue;
+        out.push_back(TraceRecord());
+        TraceRecord& r = out.back();
+        r.phase = 'C';
+        r.value = state.pendingValue;
+        r.name = state.name;
+        r.categories = nullptr;
+        r.tid = state.tid;
+        r.ts = state.pendingTs;
+        r.id = uintptr_t(state.pendingBits);
+        state.value = state.pendingValue;
+        state.bits = state.pendingBits;
+        state.ts = state.pendingTs;
+        state.pending = false;
     }
-    dataVector.clear(); //Memory is not reallocated on clear
+    std::sort(out.begin() + first, out.end(), [](const TraceRecord& a, const TraceRecord& b){ return a.ts < b.ts; });
 }
 
 /*
-    void trace_end()
+    void Tracer::signal_prepare(records)
 
-    Flush the output and close the traceFile. Also do closing details (closing bracket, remove extra comma).
+    Gives the calling thread a ring of the given number of records for the signal_* calls,
+    which are async-signal-safe: they take no lock, allocate nothing and call nothing but
+    clock_gettime, so they can be used inside signal handlers. Call it on every thread whose
+    handlers record, outside any handler, before the signals can arrive. A thread has a ring
+    in each tracer it was prepared for, up to SIGNAL_TRACERS live ones at a time. The rings are
+    drained into the trace at each flush; records that do not fit until then are dropped,
+    with a warning at end().
 */
-inline void trace_end()
+inline void Tracer::signal_prepare(size_t records)
 {
-    dataVector.back().pop_back(); dataVector.back().pop_back(); //Remove last two elements (",\n")
-    trace_flush();
-    traceFile << "\n]"; //Closing Brace of JSON
-    traceFile.close();
-    traceActive = false;
+    ThreadBuffer& buffer = thread_buffer();
+    SignalSlot* slot = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(tracerRegistryMutex);
+        for(SignalSlot& s : signalSlots)
+        {
+            uint64_t owner = s.uid.load(std::memory_order_relaxed);
+            if(owner == uid) return;
+            bool live = std::any_of(tracerRegistry.begin(), tracerRegistry.end(), [owner](const Tracer* t){ return t->uid == owner; });
+            if(!slot && !live) slot = &s; //Free, or left by a destroyed tracer
+        }
+    }
+    if(!slot)
+    {
+        std::cerr << "Error: signal handlers of one thread can record into at most " << SIGNAL_TRACERS << " tracers.\n";
+        return;
+    }
+    SignalRing* ring = buffer.signalRing;
+    records = std::max<size_t>(records, 1);
+    for(SignalRing* old = signalRings.load(); old && !ring; old = old->next)
+    {
+        bool owned = false;
+        if(old->capacity >= records && old->owned.compare_exchange_strong(owned, true)) ring = old;
+    }
+    if(!ring)
+    {
+        ring = new SignalRing(records);
+        ring->next = signalRings.load();
+        while(!signalRings.compare_exchange_weak(ring->next, ring));
+    }
+    buffer.signalRing = ring;
+    slot->uid.store(0, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    slot->ring = ring;
+    slot->uid.store(uid, std::memory_order_release);
 }
 
 /*
-    void trace_event_start(name, categories)
+    void Tracer::signal_event_start(name, categories)
+    void Tracer::signal_event_end()
+    void Tracer::signal_instant(name)
 
-    Pushes a line to the dataVector to start an event (i.e. "ph" = "B"). Inputs are self explanatory
+    As event_start, event_end and instant_global, for signal handlers (see signal_prepare).
+    Spans recorded this way nest among themselves only, so a handler should end what it
+    starts. Without a ring for this tracer on the calling thread they do nothing.
 */
-inline void trace_event_start(const char* name, const char* categories, const unsigned int tid=TID_VALUE)
+inline void Tracer::signal_event_start(const char* name, const char* categories, const unsigned int tid)
 {
-    if(!traceActive) return; //Do nothing if trace_start not called
-
-    if( dataVector.size() == dataVector.capacity() ) trace_flush(); //Flush if full
-
-    sprintf(stringBuffer,
-    "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"B\", \"pid\": %i, \"tid\": %i, \"ts\": %i},\n",
-    name,   categories, PID_VALUE,  tid,  int(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now()-startTime).count()) );
-
-    dataVector.push_back(stringBuffer);
+    signal_record('B', name, categories, tid);
 }
 
-/*
-    void trace_event_start(name, categories, argumentNames, argumentValues)
+inline void Tracer::signal_event_end(const unsigned int tid)
+{
+    signal_record('E', nullptr, nullptr, tid);
+}
 
-    Same as above, but takes arguments
-*/
-inline void trace_event_start(const char* name, const char* categories, std::initializer_list<const char*> argumentNames, std::initializer_list<const char*> argumentValues, const unsigned int tid=TID_VALUE)
+inline void Tracer::signal_instant(const char* name, const unsigned int tid)
 {
-    if(!traceActive) return; //Do nothing if trace_start not called
+    signal_record('i', name, nullptr, tid);
+}
 
-    if( dataVector.size() == dataVector.capacity() ) trace_flush(); //Flush if full
+inline void Tracer::signal_record(char phase, const char* name, const char* categories, const unsigned int tid)
+{
+    if(!traceActive.load()) return;
+    SignalRing* ring = nullptr;
+    for(SignalSlot& slot : signalSlots)
+    {
+        if(slot.uid.load(std::memory_order_acquire) == uid) ring = slot.ring;
+    }
+    if(!ring) return; //Not prepared for this tracer
+    if(ring->writing.fetch_add(1) == 0) //Outermost writer: tell flushes how old our records can be
+    {
+        ring->since.store(INT64_MIN);
+        ring->since.store(trace_timestamp());
+    }
+    signal_write(*ring, phase, name, categories, tid);
+    ring->writing.fetch_sub(1, std::memory_order_release);
+}
 
-    if(argumentNames.size() != argumentValues.size()) //Lists have different sizes
+inline void Tracer::signal_write(SignalRing& ring, char phase, const char* name, const char* categories, const unsigned int tid)
+{
+    if(ring.skipped.load(std::memory_order_relaxed) > 0 && phase != 'i') //Inside a dropped span
     {
-        std::cerr << "Error: Argument lists for " << name << " in trace_event_start are not the same size; ignoring them.\n";
-        trace_event_start(name, categories);
+        if(phase == 'B') ring.skipped.fetch_add(1, std::memory_order_relaxed);
+        else ring.skipped.fetch_sub(1, std::memory_order_relaxed);
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
     }
-    else
+    uint64_t needed = phase == 'E' ? 1 : ring.open.load(std::memory_order_relaxed) + (phase == 'B' ? 2 : 1);
+    uint64_t position = ring.claimed.load(std::memory_order_relaxed);
+    do
     {
-        sprintf(stringBuffer,
-        "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"B\", \"pid\": %i, \"tid\": %i, \"ts\": %i, \"args\": { ",
-        name,   categories, PID_VALUE,  tid,  int(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now()-startTime).count()) );
-        auto itNames  = argumentNames.begin();
-        auto itValues = argumentValues.begin();
-        for(size_t i=0; i<argumentNames.size(); i++)
+        if(position - ring.read.load(std::memory_order_acquire) + needed > ring.capacity)
         {
-            sprintf(stringBuffer + strlen(stringBuffer),
-            "\"%s\": %s",
-            *itNames++,*itValues++);
+            if(phase == 'B') ring.skipped.fetch_add(1, std::memory_order_relaxed);
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } while(!ring.claimed.compare_exchange_weak(position, position + 1));
+    if(phase == 'B') ring.open.fetch_add(1, std::memory_order_relaxed);
+    else if(phase == 'E' && ring.open.load(std::memory_order_relaxed) > 0) ring.open.fetch_sub(1, std::memory_order_relaxed);
+    SignalRecord& r = ring.records[position % ring.capacity];
+    r.phase = phase;
+    r.name = name;
+    r.categories = categories;
+    r.tid = tid;
+    r.epoch = traceEpoch.load(std::memory_order_relaxed);
+    r.ts = trace_timestamp();
+    r.sequence.store(position + 1, std::memory_order_release);
+}
+
+/*
+    void Tracer::signal_drain(out)
 
-            if(i!=argumentNames.size()-1) sprintf(stringBuffer + strlen(stringBuffer),", "); //add comma if not last variable
+    Moves the published records of every signal ring in the current session to out, in time
+    order. Caller holds bufferMutex, so there is one reader at a time.
+*/
+inline void Tracer::signal_drain(std::vector<TraceRecord>& out)
+{
+    unsigned int epoch = traceEpoch.load();
+    size_t first = out.size();
+    for(SignalRing* ring = signalRings.load(); ring; ring = ring->next)
+    {
+        signalDropped += ring->dropped.exchange(0);
+        uint64_t position = ring->read.load(std::memory_order_relaxed);
+        while(position < ring->claimed.load(std::memory_order_acquire))
+        {
+            SignalRecord& s = ring->records[position % ring->capacity];
+            if(s.sequence.load(std::memory_order_acquire) != position + 1) break; //Still being written by an interrupted handler
+            if(s.epoch == epoch)
+            {
+                out.push_back(TraceRecord());
+                TraceRecord& r = out.back();
+                r.phase = s.phase;
+                r.value = COUNTER_NONE;
+                r.name = s.name;
+                r.categories = s.categories;
+                r.tid = s.tid;
+                r.stack = 0;
+                r.ts = s.ts;
+                r.id = 0;
+            }
+            position++;
+            ring->read.store(position, std::memory_order_release);
         }
-        sprintf(stringBuffer + strlen(stringBuffer),"} },\n");
-        dataVector.push_back(stringBuffer);
     }
+    //Nested handlers can publish out of time order
+    std::stable_sort(out.begin() + first, out.end(), [](const TraceRecord& a, const TraceRecord& b){ return a.ts < b.ts; });
 }
 
 /*
-    void trace_event_end()
+    void Tracer::set_crash_handler(enabled)
 
-    Pushes a line to the dataVector to end an event (i.e. "ph" = "E").
+    While tracing, catches SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT to write what the
+    signal rings hold (see signal_prepare), and an instant named after the signal, to the
+    trace file's name with ".crash" appended, as JSON lines trace_merge can merge with the
+    trace. The handler then puts back the action it replaced and raises the signal again.
+    Only records made through the signal_* calls survive a crash; the buffers of the
+    ordinary calls may be in the middle of a change and are left alone. Takes effect at the
+    next start().
 */
-inline void trace_event_end(const unsigned int tid=TID_VALUE)
+inline void Tracer::set_crash_handler(bool enabled)
 {
-    if(!traceActive) return; //Do nothing if trace_start not called
+    crashHandler = enabled;
+}
+
+inline void Tracer::install_crash_handler()
+{
+    Tracer* none = nullptr;
+    if(!crashTracer.compare_exchange_strong(none, this))
+    {
+        std::cerr << "Warning: Another tracer has the crash handler; this one is not installed.\n";
+        return;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = crash_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for(int i=0; i<5; i++) sigaction(CRASH_SIGNALS[i], &action, &crashPrevious[i]);
+    crashInstalled = true;
+}
 
-    if( dataVector.size() == dataVector.capacity() ) trace_flush(); //Flush if full
+inline void Tracer::remove_crash_handler()
+{
+    if(!crashInstalled) return;
+    for(int i=0; i<5; i++) sigaction(CRASH_SIGNALS[i], &crashPrevious[i], nullptr);
+    crashInstalled = false;
+    crashTracer.store(nullptr);
+}
 
-    sprintf(stringBuffer,
-    "{\"ph\": \"E\", \"pid\": %i, \"tid\": %i, \"ts\": %i},\n",
-    PID_VALUE,  tid,  int(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now()-startTime).count()) );
+/*
+    const char* trace_signal_name(sig)
 
-    dataVector.push_back(stringBuffer);
+    Name of a signal as a string literal, for instants recorded from handlers.
+*/
+inline const char* trace_signal_name(int sig)
+{
+    switch(sig)
+    {
+    case SIGSEGV: return "SIGSEGV";
+    case SIGBUS: return "SIGBUS";
+    case SIGFPE: return "SIGFPE";
+    case SIGILL: return "SIGILL";
+    case SIGABRT: return "SIGABRT";
+    case SIGINT: return "SIGINT";
+    case SIGTERM: return "SIGTERM";
+    case SIGHUP: return "SIGHUP";
+    case SIGUSR1: return "SIGUSR1";
+    case SIGUSR2: return "SIGUSR2";
+    case SIGALRM: return "SIGALRM";
+    case SIGCHLD: return "SIGCHLD";
+    case SIGPIPE: return "SIGPIPE";
+    default: return "signal";
+    }
 }
 
 /*
-    void trace_event_end(argumentNames, argumentValues)
+    char* trace_signal_append(p, end, text)
+    char* trace_signal_append_int(p, end, value, digits)
 
-    Same as above, but takes arguments
+    Async-signal-safe replacements for the snprintf calls of trace_format_record: copy text,
+    or write value in decimal with at least digits digits, at p without passing end, and
+    return the new end of the output.
 */
-inline void trace_event_end(std::initializer_list<const char*> argumentNames, std::initializer_list<const char*> argumentValues, const unsigned int tid=TID_VALUE)
+inline char* trace_signal_append(char* p, char* end, const char* text)
+{
+    while(text && *text && p < end) *p++ = *text++;
+    return p;
+}
+
+inline char* trace_signal_append_int(char* p, char* end, int64_t value, int digits=1)
 {
-    if(!traceActive) return; //Do nothing if trace_start not called
+    char reversed[24];
+    int length = 0;
+    uint64_t magnitude = value < 0 ? uint64_t(0) - uint64_t(value) : uint64_t(value);
+    do
+    {
+        reversed[length++] = char('0' + magnitude % 10);
+        magnitude /= 10;
+    } while(magnitude > 0 || length < digits);
+    if(value < 0 && p < end) *p++ = '-';
+    while(length > 0 && p < end) *p++ = reversed[--length];
+    return p;
+}
 
-    if( dataVector.size() == dataVector.capacity() ) trace_flush(); //Flush if full
+/*
+    void Tracer::crash_handler(sig, info, context)
 
-    if(argumentNames.size() != argumentValues.size()) //Lists have different sizes
+    The handler set_crash_handler installs.
+*/
+inline void Tracer::crash_handler(int sig, siginfo_t* info, void* context)
+{
+    (void)info;
+    (void)context;
+    int saved = errno;
+    Tracer* tracer = crashTracer.exchange(nullptr); //A second crash while dumping goes straight through
+    if(tracer)
     {
-        std::cerr << "Error: Argument lists in trace_event_end are not the same size; ignoring them.\n";
-        trace_event_end();
+        tracer->crash_dump(sig);
+        for(int i=0; i<5; i++) sigaction(CRASH_SIGNALS[i], &tracer->crashPrevious[i], nullptr);
     }
-    else
+    errno = saved;
+    raise(sig);
+}
+
+/*
+    void Tracer::crash_dump(sig)
+
+    Writes the records of the signal rings not yet drained, and an instant for sig, to
+    crashPath. Runs in the crash handler, so it only makes async-signal-safe calls, and reads
+    the rings without draining them.
+*/
+inline void Tracer::crash_dump(int sig)
+{
+    int fd = open(crashPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) return;
+    unsigned int epoch = traceEpoch.load();
+    char line[512];
+    char* end = line + sizeof(line) - 2; //Room for " }" and the newline at the most
+    SignalRecord crash;
+    crash.phase = 'i';
+    crash.name = trace_signal_name(sig);
+    crash.categories = nullptr;
+    crash.tid = TID_VALUE;
+    crash.epoch = epoch;
+    crash.ts = trace_timestamp();
+    crash.sequence.store(1, std::memory_order_relaxed);
+    SignalRing* ring = signalRings.load();
+    uint64_t position = ring ? ring->read.load() : 0;
+    while(true)
     {
-        sprintf(stringBuffer,
-        "{\"ph\": \"E\", \"pid\": %i, \"tid\": %i, \"ts\": %i, \"args\": { ",
-        PID_VALUE,  tid,  int(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now()-startTime).count()) );
-        auto itNames  = argumentNames.begin();
-        auto itValues = argumentValues.begin();
-        for(size_t i=0; i<argumentNames.size(); i++)
+        const SignalRecord* s = &crash;
+        if(ring)
         {
-            sprintf(stringBuffer + strlen(stringBuffer),
-            "\"%s\": %s",
-            *itNames++,*itValues++);
-
-            if(i!=argumentNames.size()-1) sprintf(stringBuffer + strlen(stringBuffer),", "); //add comma if not last variable
+            if(position >= ring->claimed.load())
+            {
+                ring = ring->next;
+                position = ring ? ring->read.load() : 0;
+                continue;
+            }
+            s = &ring->records[position % ring->capacity];
+            if(s->sequence.load() != ++position || s->epoch != epoch) continue;
+        }
+        char* p = line;
+        if(s->phase != 'E')
+        {
+            p = trace_signal_append(p, end, "{\"name\": \"");
+            p = trace_signal_append(p, end, s->name);
+            p = trace_signal_append(p, end, "\", ");
+        }
+        else p = trace_signal_append(p, end, "{");
+        if(s->phase == 'B')
+        {
+            p = trace_signal_append(p, end, "\"cat\": \"");
+            p = trace_signal_append(p, end, s->categories);
+            p = trace_signal_append(p, end, "\", ");
+        }
+        p = trace_signal_append(p, end, s->phase == 'B' ? "\"ph\": \"B\", \"pid\": " : s->phase == 'E' ? "\"ph\": \"E\", \"pid\": " : "\"ph\": \"i\", \"pid\": ");
+        p = trace_signal_append_int(p, end, PID_VALUE);
+        p = trace_signal_append(p, end, ", \"tid\": ");
+        p = trace_signal_append_int(p, end, s->tid);
+        p = trace_signal_append(p, end, s->phase == 'i' ? ", \"s\": \"g\", \"ts\": " : ", \"ts\": ");
+        p = trace_signal_append_int(p, end, s->ts / 1000);
+        p = trace_signal_append(p, end, ".");
+        p = trace_signal_append_int(p, end, s->ts % 1000, 3);
+        *p++ = ' ';
+        *p++ = '}';
+        *p++ = '\n';
+        for(char* out = line; out < p; )
+        {
+            ssize_t written = write(fd, out, p - out);
+            if(written <= 0) break;
+            out += written;
         }
-        sprintf(stringBuffer + strlen(stringBuffer),"} },\n");
-        dataVector.push_back(stringBuffer);
+        if(!ring) break; //The crash instant goes last
     }
+    close(fd);
 }
 
 /*
-    void trace_object_new(name, obj_pointer)
-
-    Pushes a line to the dataVector to create an object (i.e. "ph" = "N")
+    The default instance and the free functions, which act on it. See the Tracer member of the
+    same name for details.
 */
+static Tracer defaultTracer;
+
+inline void trace_set_process_name(const char* name) { defaultTracer.set_process_name(name); }
+inline void trace_set_writer(int backend) { defaultTracer.set_writer(backend); }
+inline void trace_set_shm_size(size_t bytes) { defaultTracer.set_shm_size(bytes); }
+inline void trace_set_buffer_size(size_t records) { defaultTracer.set_buffer_size(records); }
+inline void trace_set_memory_budget(size_t bytes) { defaultTracer.set_memory_budget(bytes); }
+inline void trace_set_sample_rate(unsigned int rate) { defaultTracer.set_sample_rate(rate); }
+inline void trace_set_output_format(int format) { defaultTracer.set_output_format(format); }
+inline void trace_set_compression(int mode) { defaultTracer.set_compression(mode); }
+inline void trace_set_counter_interval(unsigned int microseconds) { defaultTracer.set_counter_interval(microseconds); }
+inline void trace_set_min_duration(const char* name, unsigned int nanoseconds) { defaultTracer.set_min_duration(name, nanoseconds); }
+inline void trace_set_stack_capture(const char* name, bool enabled=true) { defaultTracer.set_stack_capture(name, enabled); }
+inline void trace_set_sched_stats(bool enabled) { defaultTracer.set_sched_stats(enabled); }
+inline void trace_set_kernel_markers(bool enabled) { defaultTracer.set_kernel_markers(enabled); }
+inline void trace_set_hit_interval(unsigned int milliseconds) { defaultTracer.set_hit_interval(milliseconds); }
+inline void trace_set_static_strings(bool enabled=true) { defaultTracer.set_static_strings(enabled); }
+inline void trace_set_crash_handler(bool enabled) { defaultTracer.set_crash_handler(enabled); }
+inline void trace_signal_prepare(size_t records=SIGNAL_RING_RECORDS) { defaultTracer.signal_prepare(records); }
+inline void trace_signal_event_start(const char* name, const char* categories="signal") { defaultTracer.signal_event_start(name, categories); }
+inline void trace_signal_event_end() { defaultTracer.signal_event_end(); }
+inline void trace_signal_instant(const char* name) { defaultTracer.signal_instant(name); }
+
+inline bool trace_start(const char* filename) { return defaultTracer.start(filename); }
+inline void trace_flush() { defaultTracer.flush(); }
+inline void trace_end() { defaultTracer.end(); }
+
+inline void trace_event_start(const char* name, const char* categories, const unsigned int tid=TID_VALUE)
+{
+    defaultTracer.event_start(name, categories, tid);
+}
+
+inline void trace_event_start(const char* name, const char* categories, std::initializer_list<const char*> argumentNames, std::initializer_list<const char*> argumentValues, const unsigned int tid=TID_VALUE)
+{
+    defaultTracer.event_start(name, categories, argumentNames, argumentValues, tid);
+}
+
+inline void trace_event_end(const unsigned int tid=TID_VALUE)
+{
+    defaultTracer.event_end(tid);
+}
+
+inline void trace_event_end(std::initializer_list<const char*> argumentNames, std::initializer_list<const char*> argumentValues, const unsigned int tid=TID_VALUE)
+{
+    defaultTracer.event_end(argumentNames, argumentValues, tid);
+}
+
 inline void trace_object_new(const char* name, const void* obj_pointer, const unsigned int tid=TID_VALUE)
 {
-    if(!traceActive) return; //Do nothing if trace_start not called
+    defaultTracer.object_new(name, obj_pointer, tid);
+}
+
+inline void trace_object_gone(const char* name, const void* obj_pointer, const unsigned int tid=TID_VALUE)
+{
+    defaultTracer.object_gone(name, obj_pointer, tid);
+}
+
+inline void trace_instant_global(const char* name, const unsigned int tid=TID_VALUE)
+{
+    defaultTracer.instant_global(name, tid);
+}
+
+inline void trace_counter(const char* name, std::initializer_list<const char*> key, std::initializer_list<const char*> value, const unsigned int tid=TID_VALUE)
+{
+    defaultTracer.counter(name, key, value, tid);
+}
+
+inline void trace_counter_int(const char* name, int64_t value, const unsigned int tid=TID_VALUE)
+{
+    defaultTracer.counter_int(name, value, tid);
+}
+
+inline void trace_counter_double(const char* name, double value, const unsigned int tid=TID_VALUE)
+{
+    defaultTracer.counter_double(name, value, tid);
+}
+
+inline TraceReservation trace_reserve(size_t count, const unsigned int tid=TID_VALUE)
+{
+    return defaultTracer.reserve(count, tid);
+}
 
-    if( dataVector.size() == dataVector.capacity() ) trace_flush(); //Flush if full
+inline void trace_record_batch(const std::vector<BatchEvent>& events)
+{
+    defaultTracer.record_batch(events.data(), events.size());
+}
 
-    sprintf(stringBuffer,
-    "{\"name\": \"%s\", \"ph\": \"N\", \"pid\": %i, \"tid\": %i, \"id\": %" PRIuPTR ", \"ts\": %i},\n",
-    name, PID_VALUE,  tid, (uintptr_t)obj_pointer, int(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now()-startTime).count()) );
+inline SpanContext trace_context_capture(const unsigned int tid=TID_VALUE)
+{
+    return defaultTracer.context_capture(tid);
+}
 
-    dataVector.push_back(stringBuffer);
+inline SpanContext trace_context_restore(const SpanContext& context)
+{
+    return defaultTracer.context_restore(context);
 }
 
 /*
-    void trace_object_gone(name, obj_pointer)
+    struct TraceContextScope
 
-    Pushes a line to the dataVector to destroy an object (i.e. "ph" = "D")
+    Restores a captured context on defaultTracer for the lifetime of the object, so the
+    first span started in it becomes the context's child, then puts back the one before.
+
+        auto context = trace::trace_context_capture();
+        pool.submit([context]{ trace::TraceContextScope scope(context); TRACE_SCOPE("task", "pool"); ... });
 */
-inline void trace_object_gone(const char* name, const void* obj_pointer, const unsigned int tid=TID_VALUE)
+struct TraceContextScope
 {
-    if(!traceActive) return; //Do nothing if trace_start not called
+    SpanContext previous;
 
-    if( dataVector.size() == dataVector.capacity() ) trace_flush(); //Flush if full
+    explicit TraceContextScope(const SpanContext& context) : previous(trace_context_restore(context)) {}
 
-    sprintf(stringBuffer,
-    "{\"name\": \"%s\", \"ph\": \"D\", \"pid\": %i, \"tid\": %i, \"id\": %" PRIuPTR ", \"ts\": %i},\n",
-    name, PID_VALUE,  tid, (uintptr_t)obj_pointer, int(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now()-startTime).count()) );
+    ~TraceContextScope()
+    {
+        trace_context_restore(previous);
+    }
+};
 
-    dataVector.push_back(stringBuffer);
-}
+/*
+    struct TraceSignalScope
+
+    Records a span on defaultTracer for the lifetime of the object through the signal-safe
+    calls, for timing a signal handler:
+        void on_alarm(int) { trace::TraceSignalScope scope("SIGALRM"); ... }
+    The thread must have called trace_signal_prepare.
+*/
+struct TraceSignalScope
+{
+    explicit TraceSignalScope(const char* name, const char* categories="signal")
+    {
+        trace_signal_event_start(name, categories);
+    }
+
+    ~TraceSignalScope()
+    {
+        trace_signal_event_end();
+    }
+};
 
 /*
-    void trace_instant_global(name, scope='t')
+    struct TracePoint
 
-    Pushes a line to the dataVector to create a global instant
+    One TRACE_SCOPE or TRACE_INSTANT call site. Every site is constructed before main and
+    linked into tracePoints, so all of them can be listed and toggled before they first run.
+    enabled is checked with a relaxed load, one predictable branch on the fast path.
 */
-inline void trace_instant_global(const char* name, const unsigned int tid=TID_VALUE)
+struct TracePoint
 {
-    if(!traceActive) return; //Do nothing if trace_start not called
+    const char* name;
+    const char* categories;
+    const char* file;
+    int line;
+    std::atomic<bool> enabled{true};
+    int hits; //Slot of a TRACE_COUNT site (see trace_hit_slot), or -1
+    TracePoint* next;
 
-    if( dataVector.size() == dataVector.capacity() ) trace_flush(); //Flush if full
+    TracePoint(const char* name, const char* categories, const char* file, int line, int hits=-1);
+};
 
-    sprintf(stringBuffer,
-    "{\"name\": \"%s\", \"ph\": \"i\", \"pid\": %i, \"tid\": %i, \"s\": \"g\", \"ts\": %i},\n",
-    name, PID_VALUE,  tid, int(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now()-startTime).count()) );
+static std::atomic<TracePoint*> tracePoints{nullptr}; //Every registered site, newest first
 
-    dataVector.push_back(stringBuffer);
+inline TracePoint::TracePoint(const char* name, const char* categories, const char* file, int line, int hits)
+    : name(name), categories(categories), file(file), line(line), hits(hits), next(tracePoints.load())
+{
+    while(!tracePoints.compare_exchange_weak(next, this));
 }
 
 /*
-    void trace_counter(name, key, value)
+    template<typename Site> struct TracePointSite
 
-    Pushes a line to the dataVector to create a counter event
-    key contains the names, value contains the respective values
+    Holds the TracePoint of one call site. Site is a type local to the site (see TRACE_POINT),
+    so each site gets its own instance, and as a static data member the point is constructed
+    at program start instead of when the site first runs.
 */
-inline void trace_counter(const char* name, std::initializer_list<const char*> key, std::initializer_list<const char*> value, const unsigned int tid=TID_VALUE)
+template<typename Site> struct TracePointSite
 {
-    if(!traceActive) return; //Do nothing if trace_start not called
+    static TracePoint point;
+};
 
-    if( dataVector.size() == dataVector.capacity() ) trace_flush(); //Flush if full
+template<typename Site> TracePoint TracePointSite<Site>::point(Site::name(), Site::categories(), Site::file(), Site::line());
 
-    if(key.size() != value.size()) //Lists have different sizes
+/*
+    template<typename Site> struct TraceCountSite
+
+    As TracePointSite, for a TRACE_COUNT site, whose point also gets the hit slot of its name.
+*/
+template<typename Site> struct TraceCountSite
+{
+    static TracePoint point;
+};
+
+template<typename Site> TracePoint TraceCountSite<Site>::point(Site::name(), Site::categories(), Site::file(), Site::line(), trace_hit_slot(Site::name()));
+
+/*
+    struct TraceScope
+
+    Records a span on defaultTracer for the lifetime of the object, if its site is enabled
+    when it is created. Used by TRACE_SCOPE.
+*/
+struct TraceScope
+{
+    bool recorded;
+
+    explicit TraceScope(TracePoint& point) : recorded(point.enabled.load(std::memory_order_relaxed))
     {
-        std::cerr << "Error: Argument lists for " << name << " in trace_counter are not the same size; ignoring this event.\n";
-        //return
+        if(recorded) defaultTracer.event_start(point.name, point.categories);
     }
-    else
+
+    ~TraceScope()
+    {
+        if(recorded) defaultTracer.event_end();
+    }
+};
+
+/*
+    std::vector<TracePoint*> trace_point_list()
+
+    Every registered call site, in no particular order.
+*/
+inline std::vector<TracePoint*> trace_point_list()
+{
+    std::vector<TracePoint*> points;
+    for(TracePoint* point = tracePoints.load(); point; point = point->next) points.push_back(point);
+    return points;
+}
+
+/*
+    int trace_enable_points(pattern, enabled)
+
+    Switches on or off every call site whose name, categories or "file:line" matches the
+    shell-style pattern (e.g. "Method1*", "lab2pt1.cpp:*"). Output is the number of sites
+    matched. Takes effect immediately, even while tracing.
+*/
+inline int trace_enable_points(const char* pattern, bool enabled)
+{
+    int matched = 0;
+    char where[PATH_MAX + 16];
+    for(TracePoint* point = tracePoints.load(); point; point = point->next)
     {
-        sprintf(stringBuffer,
-        "{\"name\": \"%s\", \"ph\": \"C\", \"pid\": %i, \"tid\": %i, \"ts\": %i, \"args\": { ",
-        name, PID_VALUE,  tid, int(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now()-startTime).count()) );
-        auto itNames  = key.begin();
-        auto itValues = value.begin();
-        for(size_t i=0; i<key.size(); i++)
+        snprintf(where, sizeof(where), "%s:%i", point->file, point->line);
+        if(fnmatch(pattern, point->name, 0) == 0 || fnmatch(pattern, point->categories, 0) == 0 || fnmatch(pattern, where, 0) == 0)
         {
-            sprintf(stringBuffer + strlen(stringBuffer),
-            "\"%s\": %s",
-            *itNames++,*itValues++);
+            point->enabled.store(enabled, std::memory_order_relaxed);
+            matched++;
+        }
+    }
+    return matched;
+}
 
-            if(i!=key.size()-1) sprintf(stringBuffer + strlen(stringBuffer),", "); //add comma if not last variable
+/*
+    void trace_apply_disable_list()
+
+    Disables the call sites matching the comma-separated patterns in the TRACELIB_DISABLE
+    environment variable, e.g. TRACELIB_DISABLE="Method1Incr,lab2Pt2.cpp:*". Run by every
+    start() so a site can be switched off without rebuilding.
+*/
+inline void trace_apply_disable_list()
+{
+    const char* list = getenv("TRACELIB_DISABLE");
+    if(!list) return;
+    std::string patterns = list;
+    size_t begin = 0;
+    while(begin <= patterns.size())
+    {
+        size_t end = patterns.find(',', begin);
+        if(end == std::string::npos) end = patterns.size();
+        std::string pattern = patterns.substr(begin, end - begin);
+        if(!pattern.empty() && trace_enable_points(pattern.c_str(), false) == 0)
+        {
+            std::cerr << "Warning: TRACELIB_DISABLE pattern \"" << pattern << "\" matches no trace point.\n";
         }
-        sprintf(stringBuffer + strlen(stringBuffer),"} },\n");
-        dataVector.push_back(stringBuffer);
+        begin = end + 1;
     }
 }
 
 }
 
+/*
+    TRACE_SITE(holder, name, categories)
+
+    The trace::TracePoint registered for this call site, a static member of holder (one of
+    trace::TracePointSite or trace::TraceCountSite). name and categories must be string
+    literals. The site is identified by a struct local to a lambda, which is unique to each
+    expansion of the macro.
+*/
+#define TRACE_SITE(holder_, name_, categories_) \
+    ([]() -> trace::TracePoint& { \
+        struct Site \
+        { \
+            static const char* name() { return name_; } \
+            static const char* categories() { return categories_; } \
+            static const char* file() { return __FILE__; } \
+            static int line() { return __LINE__; } \
+        }; \
+        return holder_<Site>::point; \
+    }())
+
+#define TRACE_POINT(name_, categories_) TRACE_SITE(trace::TracePointSite, name_, categories_)
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+/*
+    TRACE_SCOPE(name, categories)
+
+    Records a span from here to the end of the enclosing scope, unless the site is disabled.
+*/
+#define TRACE_SCOPE(name_, categories_) trace::TraceScope TRACE_CONCAT(traceScope, __LINE__)(TRACE_POINT(name_, categories_))
+
+/*
+    TRACE_INSTANT(name, categories)
+
+    Records a global instant, unless the site is disabled.
+*/
+#define TRACE_INSTANT(name_, categories_) \
+    do { \
+        trace::TracePoint& tracePoint = TRACE_POINT(name_, categories_); \
+        if(tracePoint.enabled.load(std::memory_order_relaxed)) trace::defaultTracer.instant_global(tracePoint.name); \
+    } while(0)
+
+/*
+    TRACE_COUNT(name)
+
+    Counts a hit of name on the calling thread, unless the site is disabled. Sites with the
+    same name share one count, written as a counter of hits since trace_start at each flush.
+*/
+#define TRACE_COUNT(name_) \
+    do { \
+        trace::TracePoint& tracePoint = TRACE_SITE(trace::TraceCountSite, name_, "count"); \
+        if(tracePoint.enabled.load(std::memory_order_relaxed)) trace::trace_hit(tracePoint.hits); \
+    } while(0)
+
 #endif // TRACELIB_H_INCLUDED
@@ -0,0 +1,627 @@
+/*
+    Helpers for the tools that read trace files written by tracelib.
+
+    TraceFile maps a trace into memory and walks its events without copying them: each
+    TraceEvent points into the mapping, with its name, category, phase, pid, tid and
+    timestamp picked out in one pass over the text. A TraceFilter selects events by name, tid
+    and time range, and scan_parallel splits the file between threads. When the trace has a
+    chunk index, a time range only reads the chunks that overlap it, and a tid filter only
+    the chunks holding those threads, from the first event of one.
+
+    Current Classes:
+
+    TraceFile
+    TraceFilter
+
+    Current Functions:
+
+    read_trace_file
+    parse_event
+    event_is_index
+    event_arg
+*/
+#ifndef TRACEREADER_H_INCLUDED
+#define TRACEREADER_H_INCLUDED
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cfloat>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <thread>
+#include <algorithm>
+
+#ifdef TRACELIB_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+namespace trace
+{
+
+const double NO_TIMESTAMP = -1e300; //Of metadata events, which carry none
+
+/*
+    struct TraceChunk
+
+    One entry of the chunk index at the end of an uncompressed tracelib trace: where a batch
+    of events is in the file, the first and last timestamps in it, in microseconds, how many
+    metadata events it holds, and where the first event of each tid in it is. A chunk of
+    metadata only has first greater than last; one from an older file has no threads.
+*/
+struct TraceChunk
+{
+    uint64_t offset;
+    uint64_t length;
+    double first;
+    double last;
+    size_t metadata;
+    std::vector<std::pair<int, uint64_t>> threads; //tid, file offset
+};
+
+/*
+    bool read_trace_file(filename, out)
+
+    Reads a whole trace file into out, decompressing .gz files when built with zlib.
+    Output is true if successful, false otherwise.
+*/
+inline bool read_trace_file(const char* filename, std::string& out)
+{
+#ifdef TRACELIB_WITH_ZLIB
+    gzFile compressed = gzopen(filename, "rb"); //Reads uncompressed files unchanged
+    if(compressed)
+    {
+        out.clear();
+        char buffer[1 << 16];
+        int length;
+        while((length = gzread(compressed, buffer, sizeof(buffer))) > 0) out.append(buffer, length);
+        gzclose(compressed);
+        return true;
+    }
+#endif
+    std::ifstream file(filename, std::ios::binary);
+    if(!file.is_open())
+    {
+        std::cerr << "Error: Unable to open trace file \"" << filename << "\".\n";
+        return false;
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    out = contents.str();
+    return true;
+}
+
+/*
+    struct TraceString
+
+    A string inside the trace text, escapes kept as written. Compares with plain strings
+    without copying.
+*/
+struct TraceString
+{
+    const char* data;
+    size_t length;
+
+    TraceString() : data(""), length(0) {}
+    TraceString(const char* data, size_t length) : data(data), length(length) {}
+    bool operator==(const char* other) const { return strlen(other) == length && memcmp(data, other, length) == 0; }
+    bool operator==(const std::string& other) const { return other.size() == length && memcmp(data, other.data(), length) == 0; }
+    bool operator!=(const char* other) const { return !(*this == other); }
+    bool operator!=(const std::string& other) const { return !(*this == other); }
+    bool operator<(const TraceString& other) const
+    {
+        int order = memcmp(data, other.data, std::min(length, other.length));
+        return order < 0 || (order == 0 && length < other.length);
+    }
+    bool empty() const { return length == 0; }
+    std::string str() const { return std::string(data, length); }
+};
+
+/*
+    struct TraceEvent
+
+    One event of a TraceFile, pointing into it. Fields the event does not have are left
+    empty, 0, '?' for the phase, and NO_TIMESTAMP for the timestamp. The ends of spans carry
+    no name in tracelib output.
+*/
+struct TraceEvent
+{
+    const char* text; //The event's object, braces included
+    size_t length;
+    char phase;
+    TraceString name;
+    TraceString cat;
+    int pid;
+    int tid;
+    double ts;
+    double dur; //Of complete ("X") events
+};
+
+/*
+    const char* parse_event(p, end, event)
+
+    Parses the next event object from p, filling in event. Output is a pointer just past the
+    event, or nullptr if there is no complete event before end.
+*/
+inline const char* parse_event(const char* p, const char* end, TraceEvent& event)
+{
+    p = (const char*)memchr(p, '{', end - p);
+    if(!p) return nullptr;
+    event.text = p;
+    event.phase = '?';
+    event.name = TraceString();
+    event.cat = TraceString();
+    event.pid = 0;
+    event.tid = 0;
+    event.ts = NO_TIMESTAMP;
+    event.dur = 0;
+    int depth = 0;
+    for(; p < end; p++)
+    {
+        if(*p == '"')
+        {
+            const char* key = ++p;
+            while(p < end && *p != '"') p += (*p == '\\') ? 2 : 1;
+            if(p >= end) return nullptr;
+            if(depth != 1) continue;
+            TraceString found(key, p - key);
+            const char* value = p + 1;
+            while(value < end && *value == ' ') value++;
+            if(value >= end || *value != ':') continue; //A string value, not a key
+            value++;
+            while(value < end && *value == ' ') value++;
+            if(value < end && *value == '"')
+            {
+                bool phase = found == "ph";
+                TraceString* field = found == "name" ? &event.name : found == "cat" ? &event.cat : nullptr;
+                if(!field && !phase) continue; //Read by the loop as any other string
+                const char* begin = ++value;
+                while(value < end && *value != '"') value += (*value == '\\') ? 2 : 1;
+                if(value >= end) return nullptr;
+                if(phase) event.phase = value > begin ? *begin : '?';
+                else *field = TraceString(begin, value - begin);
+                p = value;
+            }
+            else if(found == "ts") event.ts = strtod(value, nullptr);
+            else if(found == "dur") event.dur = strtod(value, nullptr);
+            else if(found == "pid") event.pid = atoi(value);
+            else if(found == "tid") event.tid = atoi(value);
+        }
+        else if(*p == '{' || *p == '[') depth++;
+        else if((*p == '}' || *p == ']') && --depth == 0)
+        {
+            event.length = p + 1 - event.text;
+            return p + 1;
+        }
+    }
+    return nullptr; //Truncated object at the end of the file
+}
+
+/*
+    bool event_is_index(event)
+
+    Output is true for the events of the chunk index, whose offsets only hold in the file they
+    were read from, so tools writing a new file leave them out.
+*/
+inline bool event_is_index(const TraceEvent& event)
+{
+    return event.phase == 'M' && (event.name == "trace_index" || event.name == "trace_index_at");
+}
+
+/*
+    bool event_arg(event, key, value)
+
+    Finds "key": <number> in the event's "args". Output is true if found.
+*/
+inline bool event_arg(const TraceEvent& event, const char* key, double& value)
+{
+    std::string pattern = std::string("\"") + key + "\":";
+    const char* end = event.text + event.length;
+    int depth = 0;
+    for(const char* p = event.text; p < end; p++)
+    {
+        if(*p == '{' || *p == '[') depth++;
+        else if(*p == '}' || *p == ']') depth--;
+        else if(*p == '"')
+        {
+            if(depth == 2 && size_t(end - p) > pattern.size() && strncmp(p, pattern.c_str(), pattern.size()) == 0)
+            {
+                char* parsed = nullptr;
+                value = strtod(p + pattern.size(), &parsed);
+                return parsed != p + pattern.size();
+            }
+            for(p++; p < end && *p != '"'; p++) //Skips the string, escapes included
+            {
+                if(*p == '\\') p++;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+    struct TraceFilter
+
+    Which events a scan of a TraceFile passes on: any of names (all if empty), any of tids
+    (all if empty), timestamps from..to in microseconds. Metadata events have no timestamp
+    and pass the time range unless metadata is false. As ends of spans have no name, a
+    filter by name keeps only their starts.
+*/
+struct TraceFilter
+{
+    std::vector<std::string> names;
+    std::vector<int> tids;
+    double from = -DBL_MAX;
+    double to = DBL_MAX;
+    bool metadata = true;
+
+    bool matches(const TraceEvent& event) const
+    {
+        if(!names.empty() && std::find_if(names.begin(), names.end(), [&](const std::string& name){ return event.name == name; }) == names.end()) return false;
+        if(!tids.empty() && std::find(tids.begin(), tids.end(), event.tid) == tids.end()) return false;
+        if(event.ts == NO_TIMESTAMP) return metadata;
+        return event.ts >= from && event.ts <= to;
+    }
+};
+
+/*
+    class TraceFile
+
+    A trace file mapped into memory, or decompressed into it for .gz files when built with
+    zlib, read through a forward iterator of TraceEvents:
+
+        trace::TraceFile file;
+        if(!file.open("trace.json")) return 1;
+        for(const trace::TraceEvent& event : file) ...
+
+    The events point into the file, so it must outlive them. Iteration is in file order.
+    tracelib writes in time order across flushes, except for events with timestamps from
+    before their recording call (trace_reserve, trace_record_batch) and for held records
+    spilled early by a thread stuck in a call (see Tracer::merge_streams). Files from older
+    versions are in time order within each flush only.
+*/
+class TraceFile
+{
+public:
+    class iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef TraceEvent value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const TraceEvent* pointer;
+        typedef const TraceEvent& reference;
+
+        iterator() : p(nullptr), end(nullptr) {}
+        iterator(const char* begin, const char* end) : p(begin), end(end) { ++*this; }
+        const TraceEvent& operator*() const { return event; }
+        const TraceEvent* operator->() const { return &event; }
+        iterator& operator++()
+        {
+            p = p ? parse_event(p, end, event) : nullptr;
+            return *this;
+        }
+        bool operator==(const iterator& other) const { return p == other.p; }
+        bool operator!=(const iterator& other) const { return p != other.p; }
+
+    private:
+        const char* p; //Just past the current event, nullptr at the end
+        const char* end;
+        TraceEvent event;
+    };
+
+    typedef std::pair<const char*, const char*> Range;
+
+    TraceFile() : text(nullptr), length(0), mapped(nullptr) {}
+    ~TraceFile() { close(); }
+    TraceFile(const TraceFile&) = delete;
+    TraceFile& operator=(const TraceFile&) = delete;
+
+    bool open(const char* filename);
+    void close();
+    const char* data() const { return text; }
+    size_t size() const { return length; }
+    const std::vector<TraceChunk>& index() const { return chunks; } //Empty if the file has none
+    iterator begin() const { return iterator(text, text + length); }
+    iterator end() const { return iterator(); }
+
+    template<typename Callback> void scan(const TraceFilter& filter, Callback callback) const;
+    template<typename Callback> size_t scan_parallel(const TraceFilter& filter, size_t parts, Callback callback) const;
+    std::vector<TraceEvent> events(const TraceFilter& filter = TraceFilter()) const;
+
+private:
+    bool read_index();
+    std::vector<std::vector<Range>> split(const TraceFilter& filter, size_t parts) const;
+
+    const char* text;
+    size_t length;
+    void* mapped;
+    std::string decompressed;
+    std::vector<TraceChunk> chunks;
+};
+
+/*
+    bool TraceFile::open(filename)
+
+    Maps the file, and reads its chunk index if it has one. Output is true if successful,
+    false otherwise.
+*/
+inline bool TraceFile::open(const char* filename)
+{
+    close();
+    int fd = ::open(filename, O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0)
+    {
+        if(fd >= 0) ::close(fd);
+        std::cerr << "Error: Unable to open trace file \"" << filename << "\".\n";
+        return false;
+    }
+    unsigned char magic[2] = { 0, 0 };
+    if(pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b) //gzip
+    {
+        ::close(fd);
+#ifdef TRACELIB_WITH_ZLIB
+        if(!read_trace_file(filename, decompressed)) return false;
+        text = decompressed.data();
+        length = decompressed.size();
+        return true;
+#else
+        std::cerr << "Error: \"" << filename << "\" is compressed; build with TRACELIB_WITH_ZLIB to read it.\n";
+        return false;
+#endif
+    }
+    length = info.st_size;
+    if(length > 0)
+    {
+        mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapped == MAP_FAILED)
+        {
+            mapped = nullptr;
+            length = 0;
+            ::close(fd);
+            std::cerr << "Error: Unable to map trace file \"" << filename << "\".\n";
+            return false;
+        }
+        madvise(mapped, length, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+    text = mapped ? (const char*)mapped : "";
+    if(!read_index()) chunks.clear();
+    return true;
+}
+
+/*
+    bool TraceFile::read_index()
+
+    Reads the chunk index tracelib writes at the end of an uncompressed trace: the last event,
+    "trace_index_at", gives the offset of the "trace_index" event that lists the chunks.
+    Output is false if the file has no index (compressed, cut short, or not from tracelib).
+*/
+inline bool TraceFile::read_index()
+{
+    const char* end = text + length;
+    std::string tail(length > 256 ? end - 256 : text, end);
+    size_t found = tail.find("\"trace_index_at\"");
+    if(found == std::string::npos || (found = tail.find("\"offset\":", found)) == std::string::npos) return false;
+    uint64_t indexAt = strtoull(tail.c_str() + found + 9, nullptr, 10);
+    if(indexAt >= length) return false;
+
+    TraceEvent index;
+    if(!parse_event(text + indexAt, end, index) || index.name != "trace_index") return false;
+    const char* listEnd = index.text + index.length;
+    const std::string list = "\"chunks\":";
+    const char* p = std::search(index.text, listEnd, list.begin(), list.end());
+    if(p == listEnd) return false;
+    auto number = [](const char* begin, const char* end, const std::string& key, double& value) //In one chunk entry
+    {
+        const char* at = std::search(begin, end, key.begin(), key.end());
+        if(at == end) return false;
+        char* parsed = nullptr;
+        value = strtod(at + key.size(), &parsed);
+        return parsed != at + key.size();
+    };
+    const std::string threadList = "\"threads\": [";
+    chunks.clear();
+    for(p += list.size(); ; p++)
+    {
+        while(p < listEnd && *p != '{' && *p != ']') p++; //Entries hold arrays but no objects
+        if(p >= listEnd || *p == ']') break;
+        const char* close = (const char*)memchr(p, '}', listEnd - p);
+        if(!close) return false;
+        TraceChunk chunk;
+        double offset = 0, size = 0, metadata = 0;
+        if(!number(p, close, "\"offset\":", offset) || !number(p, close, "\"length\":", size)) return false;
+        number(p, close, "\"metadata\":", metadata);
+        if(!number(p, close, "\"first\":", chunk.first) || !number(p, close, "\"last\":", chunk.last))
+        {
+            chunk.first = DBL_MAX;
+            chunk.last = -DBL_MAX;
+        }
+        chunk.offset = uint64_t(offset);
+        chunk.length = uint64_t(size);
+        chunk.metadata = size_t(metadata);
+        const char* thread = std::search(p, close, threadList.begin(), threadList.end());
+        for(thread += thread == close ? 0 : threadList.size(); thread < close && *thread != ']'; thread++)
+        {
+            if(*thread != '[') continue;
+            char* parsed = nullptr;
+            long tid = strtol(thread + 1, &parsed, 10);
+            if(*parsed != ',') return false;
+            uint64_t at = strtoull(parsed + 1, &parsed, 10);
+            chunk.threads.push_back(std::make_pair(int(tid), at));
+            thread = parsed;
+        }
+        chunks.push_back(chunk);
+        p = close;
+    }
+    return !chunks.empty();
+}
+
+/*
+    void TraceFile::close()
+
+    Unmaps the file. Events from it are no longer valid.
+*/
+inline void TraceFile::close()
+{
+    if(mapped) munmap(mapped, length);
+    mapped = nullptr;
+    text = nullptr;
+    length = 0;
+    std::string().swap(decompressed);
+    chunks.clear();
+}
+
+/*
+    std::vector<std::vector<Range>> TraceFile::split(filter, parts)
+
+    Divides the file into at most parts pieces of about the same size, each a list of ranges
+    in file order that start on an event. With a chunk index the pieces are made of the
+    chunks the filter's time range overlaps, and those holding metadata; with a tid filter
+    too, only of those holding one of its tids, each from the first event of one. Without an
+    index the file is cut at the start of a line beginning with a brace, where tracelib,
+    trace_merge and most other writers start each event.
+*/
+inline std::vector<std::vector<TraceFile::Range>> TraceFile::split(const TraceFilter& filter, size_t parts) const
+{
+    std::vector<Range> ranges;
+    if(!chunks.empty())
+    {
+        for(const TraceChunk& chunk : chunks)
+        {
+            if(chunk.offset + chunk.length > length) continue;
+            if((chunk.last >= filter.from && chunk.first <= filter.to) || (filter.metadata && chunk.metadata > 0))
+            {
+                uint64_t first = chunk.offset;
+                if(!filter.tids.empty() && !chunk.threads.empty())
+                {
+                    first = chunk.offset + chunk.length; //Past the chunk unless one of the tids is in it
+                    for(auto const& thread : chunk.threads)
+                    {
+                        bool wanted = std::find(filter.tids.begin(), filter.tids.end(), thread.first) != filter.tids.end();
+                        if(wanted && thread.second >= chunk.offset) first = std::min(first, thread.second);
+                    }
+                    if(first == chunk.offset + chunk.length) continue;
+                }
+                const char* begin = text + first;
+                const char* end = text + chunk.offset + chunk.length;
+                if(!ranges.empty() && ranges.back().second == begin) ranges.back().second = end;
+                else ranges.push_back(Range(begin, end));
+            }
+        }
+    }
+    else if(length > 0) ranges.push_back(Range(text, text + length));
+
+    size_t total = 0;
+    for(const Range& range : ranges) total += range.second - range.first;
+    parts = std::max<size_t>(1, parts);
+    size_t target = (total + parts - 1) / parts; //Bytes per piece
+    std::vector<std::vector<Range>> pieces(1);
+    size_t taken = 0; //Bytes in the last piece
+    for(Range range : ranges)
+    {
+        while(range.first < range.second)
+        {
+            size_t left = range.second - range.first;
+            if(pieces.size() == parts || taken + left <= target)
+            {
+                pieces.back().push_back(range);
+                taken += left;
+                break;
+            }
+            const char* cut = range.first + (target > taken ? target - taken : 0);
+            if(cut > range.first) //Ranges start on an event, anywhere else moves on to one
+            {
+                while(cut < range.second && !(cut[0] == '{' && cut[-1] == '\n')) cut++;
+            }
+            if(cut > range.first) pieces.back().push_back(Range(range.first, cut));
+            taken += cut - range.first;
+            range.first = cut;
+            if(range.first < range.second)
+            {
+                pieces.push_back(std::vector<Range>());
+                taken = 0;
+            }
+        }
+    }
+    if(pieces.back().empty() && pieces.size() > 1) pieces.pop_back();
+    return pieces;
+}
+
+/*
+    void TraceFile::scan(filter, callback)
+
+    Calls callback(event) for each event the filter matches, in file order.
+*/
+template<typename Callback>
+inline void TraceFile::scan(const TraceFilter& filter, Callback callback) const
+{
+    for(const std::vector<Range>& piece : split(filter, 1))
+    {
+        for(const Range& range : piece)
+        {
+            for(iterator it(range.first, range.second), end; it != end; ++it)
+            {
+                if(filter.matches(*it)) callback(*it);
+            }
+        }
+    }
+}
+
+/*
+    size_t TraceFile::scan_parallel(filter, parts, callback)
+
+    Same as scan, but split into up to parts pieces scanned by their own threads, calling
+    callback(part, event) for each event matched. The pieces follow each other in the
+    file, and each is scanned in order, so results kept per part can be joined in part order.
+    The callback is called from several threads at once. Output is the number of pieces.
+*/
+template<typename Callback>
+inline size_t TraceFile::scan_parallel(const TraceFilter& filter, size_t parts, Callback callback) const
+{
+    std::vector<std::vector<Range>> pieces = split(filter, parts);
+    std::vector<std::thread> threads;
+    for(size_t i=0; i<pieces.size(); i++)
+    {
+        threads.push_back(std::thread([&, i]()
+        {
+            for(const Range& range : pieces[i])
+            {
+                for(iterator it(range.first, range.second), end; it != end; ++it)
+                {
+                    if(filter.matches(*it)) callback(i, *it);
+                }
+            }
+        }));
+    }
+    for(auto& thread : threads) thread.join();
+    return pieces.size();
+}
+
+/*
+    std::vector<TraceEvent> TraceFile::events(filter)
+
+    The events the filter matches, in file order, parsed on one thread per core.
+*/
+inline std::vector<TraceEvent> TraceFile::events(const TraceFilter& filter) const
+{
+    std::vector<std::vector<TraceEvent>> parts(std::max(1u, std::thread::hardware_concurrency()));
+    scan_parallel(filter, parts.size(), [&](size_t part, const TraceEvent& event){ parts[part].push_back(event); });
+    std::vector<TraceEvent> all;
+    size_t count = 0;
+    for(auto const& part : parts) count += part.size();
+    all.reserve(count);
+    for(auto const& part : parts) all.insert(all.end(), part.begin(), part.end());
+    return all;
+}
+
+}
+
+#endif // TRACEREADER_H_INCLUDED